@@ -0,0 +1,156 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#pragma once
+
+#include "types.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace pilecode {
+
+	// One bit per cell of world z-level. Rows are padded to 64-bit words,
+	// so range queries test up to 64 cells with one word operation
+	class Bitboard {
+	public:
+		Bitboard() {}
+		Bitboard(Si32 w, Si32 h)
+			: w_(w)
+			, h_(h)
+			, stride_((w + 63) / 64)
+			, words_(stride_ * h, 0)
+		{}
+
+		bool get(Si32 x, Si32 y) const
+		{
+			if (x < 0 || x >= w_ || y < 0 || y >= h_) {
+				return false;
+			}
+			return (words_[y * stride_ + x / 64] >> (x % 64)) & 1;
+		}
+
+		void set(Si32 x, Si32 y, bool value)
+		{
+			Ui64& word = words_[y * stride_ + x / 64];
+			Ui64 bit = Ui64(1) << (x % 64);
+			word = value ? (word | bit) : (word & ~bit);
+		}
+
+		void flip(Si32 x, Si32 y)
+		{
+			words_[y * stride_ + x / 64] ^= Ui64(1) << (x % 64);
+		}
+
+		void Clear()
+		{
+			std::fill(words_.begin(), words_.end(), 0);
+		}
+
+		// Returns true iff any cell in rectangle [x1, x2] x [y1, y2] is set
+		bool Any(Si32 x1, Si32 y1, Si32 x2, Si32 y2) const
+		{
+			if (!Clip(x1, y1, x2, y2)) {
+				return false;
+			}
+			for (Si32 y = y1; y <= y2; y++) {
+				const Ui64* row = &words_[y * stride_];
+				for (Si32 i = x1 / 64; i <= x2 / 64; i++) {
+					if (row[i] & Mask(i, x1, x2)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		// Calls f(x, y) for every set cell row by row, 64 cells are tested
+		// with one word operation, so empty parts of board are skipped fast
+		template <class F>
+		void ForEach(F f) const
+		{
+			for (Si32 y = 0; y < h_; y++) {
+				const Ui64* row = &words_[y * stride_];
+				for (Si32 i = 0; i < stride_; i++) {
+					ForEachBit(row[i], i * 64, y, f);
+				}
+			}
+		}
+
+		// Same for cells that are set and not set in `mask' of the same size
+		template <class F>
+		void ForEachExcept(const Bitboard& mask, F f) const
+		{
+			for (Si32 y = 0; y < h_; y++) {
+				const Ui64* row = &words_[y * stride_];
+				const Ui64* masked = &mask.words_[y * stride_];
+				for (Si32 i = 0; i < stride_; i++) {
+					ForEachBit(row[i] & ~masked[i], i * 64, y, f);
+				}
+			}
+		}
+
+		// accessors
+		Si32 w() const { return w_; }
+		Si32 h() const { return h_; }
+	private:
+		// Intersects rectangle with board, returns false if nothing is left
+		bool Clip(Si32& x1, Si32& y1, Si32& x2, Si32& y2) const
+		{
+			x1 = std::max(x1, 0);
+			y1 = std::max(y1, 0);
+			x2 = std::min(x2, w_ - 1);
+			y2 = std::min(y2, h_ - 1);
+			return x1 <= x2 && y1 <= y2;
+		}
+
+		template <class F>
+		static void ForEachBit(Ui64 word, Si32 x, Si32 y, F& f)
+		{
+			for (; word; word >>= 1, x++) {
+				if (word & 1) {
+					f(x, y);
+				}
+			}
+		}
+
+		// Bits of word `i' of row that cover cells [x1, x2]
+		static Ui64 Mask(Si32 i, Si32 x1, Si32 x2)
+		{
+			Ui64 mask = ~Ui64(0);
+			if (i == x1 / 64) {
+				mask &= ~Ui64(0) << (x1 % 64);
+			}
+			if (i == x2 / 64) {
+				mask &= ~Ui64(0) >> (63 - x2 % 64);
+			}
+			return mask;
+		}
+	private:
+		Si32 w_ = 0;
+		Si32 h_ = 0;
+		Si32 stride_ = 0; // words per row
+		std::vector<Ui64> words_;
+	};
+
+}
@@ -28,6 +28,8 @@
 //#define MOD_XMAS
 #define SHOW_FPS
 
+#include "types.h"
+
 #include "engine/easy.h"
 
 namespace ae {
@@ -38,18 +40,8 @@ namespace ae {
 namespace pilecode {
 	using ae::Sprite;
 	using ae::Sound;
-	using ae::Si8;
-	using ae::Ui8;
-	using ae::Si16;
-	using ae::Ui16;
-	using ae::Si32;
-	using ae::Ui32;
-	using ae::Si64;
-	using ae::Ui64;
 	using ae::Rgba;
 	using ae::Vec2F;
-	using ae::Vec2Si32;
-	using ae::Vec3Si32;
 
 	template <class T>
 	bool IsKeyOnce(T t)
@@ -24,6 +24,8 @@
 #include "levels.h"
 #include "sfx.h"
 
+#include <limits>
+
 namespace pilecode {
 
 	using namespace ae;
@@ -37,7 +39,11 @@ namespace pilecode {
     
 	void Game::Restart()
 	{
+		vp_->set_world(nullptr); // stop listening before previous world is destroyed
 		world_.reset(initWorld_->Clone());
+		world_->set_events(&sfxEvents_);
+		world_->SetJournalLimit(journalLimit_);
+		timeline_.Reset(*world_);
 		vp_->set_world(world_.get());
 
 		lastUpdateTime_ = 0.0;
@@ -323,6 +329,7 @@ namespace pilecode {
     void Game::EraseLetter()
     {
         world_->SetLetter(wmouse_, kLtSpace);
+        timeline_.Reset(*world_);
         auto res = initWorld_->SetLetter(wmouse_, kLtSpace);
         if (res.IsOk()) {
             Response(kRsUndone);
@@ -380,6 +387,14 @@ namespace pilecode {
 			PlayOrPause();
 		}
 
+		if (IsKeyOnce('[')) {
+			StepBackward();
+		}
+
+		if (IsKeyOnce(']')) {
+			StepForward();
+		}
+
 		if (IsKeyOnce(kKey1)) {
 			simSpeed_ = 1.0;
 		}
@@ -437,6 +452,7 @@ namespace pilecode {
 						Robot original; // to sync seed in initWorld_ and world_
 						world_->SwitchRobot(wmouse_, original);
 						initWorld_->SwitchRobot(wmouse_, original);
+						timeline_.Reset(*world_);
 						Response(kRsOk);
 					}
 				} 
@@ -449,6 +465,7 @@ namespace pilecode {
 					else {
 						if (IsKeyOnce(kKeyMouseLeft)) {
 							world_->SetLetter(wmouse_, placeLetter_);
+							timeline_.Reset(*world_);
 							auto res = initWorld_->SetLetter(wmouse_, placeLetter_);
 							Response(res);
 						}
@@ -471,7 +488,19 @@ namespace pilecode {
 			lastUpdateTime_ = time;
 		}
         if (fastForward_) {
-            world_->Simulate();
+            // run as many steps as fit into frame budget
+            double deadline = time + fastForwardSecondsPerFrame_;
+            size_t steps = world_->steps();
+            do {
+                if (!Step(std::numeric_limits<size_t>::max()) || world_->IsOutputCorrect()) {
+                    break;
+                }
+            } while (Time() < deadline);
+            double dt = time - lastUpdateTime_;
+            if (dt > 1e-4) {
+                double stepsPerSecond = double(world_->steps() - steps) / dt;
+                stepsPerSecond_ = 0.1 * stepsPerSecond + 0.9 * stepsPerSecond_;
+            }
             lastUpdateTime_ = time;
             lastProgress_ = 0.0;
             vp_->set_progress(0.0);
@@ -486,7 +515,7 @@ namespace pilecode {
                         break;
                     }
                     else {
-                        world_->Simulate();
+                        Step();
                         lastUpdateTime_ = time;
                         lastProgress_ = progress - 1.0;
                         time = Time();
@@ -506,8 +535,26 @@ namespace pilecode {
 		UpdateTools();
 	}
 
+	// Makes one step or jumps over up to `maxSteps' steps (see World::Advance)
+	// Returns false iff simulation is stopped because it was found to loop forever
+	bool Game::Step(size_t maxSteps)
+	{
+		bool looped = world_->loop() != 0;
+		world_->Advance(maxSteps);
+		timeline_.Record(*world_);
+		if (!looped && world_->loop() != 0 && !world_->IsOutputCorrect()) {
+			simPaused_ = true;
+			fastForward_ = false;
+			return false;
+		}
+		return true;
+	}
+
 	bool Game::ControlTools()
 	{
+		if (timelineSlider_ && !timelineSlider_->Control()) {
+			return false;
+		}
 		for (auto i = buttons_.rbegin(), e = buttons_.rend(); i != e; ++i) {
 			PButton& button = *i;
 			if (!button.Control()) {
@@ -519,6 +566,9 @@ namespace pilecode {
 
 	void Game::UpdateTools()
 	{
+		if (timelineSlider_) {
+			timelineSlider_->Update();
+		}
 		for (PButton& button : buttons_) {
 			button.Update();
 		}
@@ -526,6 +576,9 @@ namespace pilecode {
 
 	void Game::RenderTools()
 	{
+		if (timelineSlider_) {
+			timelineSlider_->Render();
+		}
 		for (PButton& button : buttons_) {
 			button.Render();
 		}
@@ -548,6 +601,36 @@ namespace pilecode {
         simPaused_ = false;
         fastForward_ = true;
     }
+
+    void Game::StepBackward()
+    {
+        simPaused_ = true;
+        fastForward_ = false;
+        // steps before jump are not in journal, but they are in timeline
+        if (world_->Undo() || (world_->steps() > 0 && timeline_.Seek(world_.get(), world_->steps() - 1))) {
+            lastProgress_ = 1.0;
+        }
+    }
+
+    void Game::StepForward()
+    {
+        simPaused_ = true;
+        fastForward_ = false;
+        if (!world_->Redo()) {
+            Step();
+        }
+        lastProgress_ = 0.0; // animate step
+        lastUpdateTime_ = 0.0;
+    }
+
+    void Game::Seek(size_t step)
+    {
+        simPaused_ = true;
+        fastForward_ = false;
+        if (timeline_.Seek(world_.get(), step)) {
+            lastProgress_ = 1.0;
+        }
+    }
     
 	void Game::DefaultPlaceMode()
 	{
@@ -646,6 +729,23 @@ namespace pilecode {
 		})->OnUpdate([=](PButton* btn) {
 			btn->SetSprite(simPaused_ || fastForward_ ? 0 : 1);
 		});
+
+		// Add timeline slider above playback buttons
+		timelineSlider_.reset(new PSlider(frmPlayback
+			.Offset(0, frmPlayback.height() + 16)
+			.Place(kCenter, Vec2Si32(frmPlayback.width() * 2, 16))));
+		timelineSlider_->Change([=](PSlider* slider) {
+			size_t range = timeline_.last() - timeline_.first();
+			Seek(timeline_.first() + size_t(slider->value() * range + 0.5f));
+		})->OnUpdate([=](PSlider* slider) {
+			size_t range = timeline_.last() - timeline_.first();
+			slider->set_enabled(range != 0);
+			if (range != 0 && !slider->drag()) {
+				size_t step = std::min(std::max(world_->steps(), timeline_.first()), timeline_.last());
+				slider->set_value(float(step - timeline_.first()) / range);
+			}
+		});
+
         AddButton(image::g_button_replay, Region::Screen(), kLeftBottom)
         ->Click([=](PButton* btn) {
             if (ConfirmModal()) {
@@ -843,7 +943,7 @@ namespace pilecode {
 						.PassEventThrough();
 				}
 				else if (placeMode_ == kPmLetter) {
-					if (Tile* tile = world_->At(wmouse_)) {
+					if (const Tile* tile = world_->At(wmouse_)) {
 						bool erase = tile->letter() == placeLetter_; // Erase if letter was already placed
 						if (tile->IsModifiable()) { // Actions is allowed
 							if (!erase && tile) {
@@ -882,30 +982,49 @@ namespace pilecode {
 		}
 
         if (show) {
+            RenderStatus();
+            ae::ShowFrame();
+        }
+	}
+
+	void Game::RenderStatus()
+	{
+        static Font font;
+        static bool loaded = false;
+        if (!loaded) {
+            font.Load("data/ui/arctic_one_bmf.fnt");
+            loaded = true;
+        }
+        char text[128];
 #ifdef SHOW_FPS
-            static double prev_time = ae::Time();
-            static double fps = 0.0;
-            double new_time = ae::Time();
-            double dt = new_time - prev_time;
-            prev_time = new_time;
-            if (dt > 1e-4) {
-                double new_fps = 1.0 / dt;
-                fps = 0.1 * new_fps + 0.9 * fps;
-                static Font font;
-                static bool loaded = false;
-                if (!loaded) {
-                    font.Load("data/ui/arctic_one_bmf.fnt");
-                    loaded = true;
-                }
-                char text[128];
-                sprintf(text, "BB:%dx%d WND:%dx%d FPS:%4.0lf",
-                        ScreenSize().x, ScreenSize().y,
-                        WindowSize().x, WindowSize().y,
-                        fps);
-                font.Draw(text, 0, 0);
-            }
+        static double prev_time = ae::Time();
+        static double fps = 0.0;
+        double new_time = ae::Time();
+        double dt = new_time - prev_time;
+        prev_time = new_time;
+        if (dt > 1e-4) {
+            double new_fps = 1.0 / dt;
+            fps = 0.1 * new_fps + 0.9 * fps;
+            sprintf(text, "BB:%dx%d WND:%dx%d FPS:%4.0lf",
+                    ScreenSize().x, ScreenSize().y,
+                    WindowSize().x, WindowSize().y,
+                    fps);
+            font.Draw(text, 0, 0);
+        }
 #endif
-            ae::ShowFrame();
+        if (fastForward_) {
+            sprintf(text, "STEP:%d SPS:%6.0lf", Si32(world_->steps()), stepsPerSecond_);
+            font.Draw(text, 0, screen::h - 32);
+        }
+        else if (world_->loop() != 0 && !world_->IsOutputCorrect()) {
+            // loop start is not known to cycle detection, only its period (exact as Step() never jumps)
+            if (world_->stalled()) {
+                sprintf(text, "STALLED: NOTHING CHANGES ANYMORE");
+            }
+            else {
+                sprintf(text, "LOOPS EVERY %d STEPS", Si32(world_->loop()));
+            }
+            font.Draw(text, 0, screen::h - 32);
         }
 	}
 
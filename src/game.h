@@ -27,7 +27,10 @@
 #include "graphics.h"
 #include "music.h"
 #include "pilecode.h"
+#include "sfx.h"
+#include "timeline.h"
 #include "ui.h"
+#include "viewport.h"
 
 #include <list>
 
@@ -64,11 +67,16 @@ namespace pilecode {
         void EraseLetter();
         bool Control();
 		void Update();
+		bool Step(size_t maxSteps = 1);
 		bool ControlTools();
 		void UpdateTools();
 		void RenderTools();
+		void RenderStatus();
         void PlayOrPause();
         void FastForward();
+        void StepBackward();
+        void StepForward();
+        void Seek(size_t step);
         void DefaultPlaceMode();
 		void SwitchPlaceMode(PlaceMode mode, Letter right, Letter down, Letter up, Letter left);
 		void SwitchPlaceMode(PlaceMode mode, Letter letter);
@@ -117,9 +125,12 @@ namespace pilecode {
 		std::unique_ptr<World> initWorld_;
 		std::unique_ptr<World> world_;
 		std::unique_ptr<ViewPort> vp_;
+		SfxWorldEvents sfxEvents_;
+		Timeline timeline_;
 
 		// timing
 		double secondsPerStepDefault_ = 0.5;
+		double fastForwardSecondsPerFrame_ = 0.004; // simulation time budget per frame
 		double lastUpdateTime_ = 0.0;
 		double lastControlTime_ = 0.0;
 
@@ -128,6 +139,8 @@ namespace pilecode {
 		bool simPaused_ = true;
         bool fastForward_ = false;
 		double simSpeed_ = 1.0;
+		double stepsPerSecond_ = 0.0; // measured in fast forward mode
+		size_t journalLimit_ = 16 * 1024 * 1024; // memory for stepping backward (in bytes)
 
 		// gameplay
 		bool tileHover_ = false;
@@ -137,6 +150,7 @@ namespace pilecode {
 		bool frameVisibility_ = true;
 		bool toolsVisibility_ = true;
 		std::list<PButton> buttons_;
+		std::unique_ptr<PSlider> timelineSlider_;
 		PlaceMode placeMode_;
 		Letter placeLetterRight_;
 		Letter placeLetterDown_;
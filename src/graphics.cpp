@@ -24,6 +24,7 @@
 
 #include "engine/easy.h"
 
+#include <algorithm>
 #include <map>
 
 namespace pilecode {
@@ -411,6 +412,58 @@ namespace pilecode {
 
 	////////////////////////////////////////////////////////////////////////////////////////////////
 
+	// Draws part of `sprite' within rectangle [lo, hi) of `layer' over it with premultiplied alpha
+	// (color of layer is already multiplied by its alpha)
+	void LayerDraw(Sprite sprite, const Si32 to_x, const Si32 to_y, Sprite layer, Vec2Si32 lo, Vec2Si32 hi,
+		Rgba blend, Ui8 opacity)
+	{
+		const Si32 x = to_x - sprite.Pivot().x;
+		const Si32 y = to_y - sprite.Pivot().y;
+		const Si32 x1 = std::max(x, lo.x);
+		const Si32 y1 = std::max(y, lo.y);
+		const Si32 x2 = std::min(x + sprite.Width(), hi.x);
+		const Si32 y2 = std::min(y + sprite.Height(), hi.y);
+		if (x1 >= x2 || y1 >= y2) {
+			return;
+		}
+		FilterDraw(sprite, x1 + sprite.Pivot().x, y1 + sprite.Pivot().y, x2 - x1, y2 - y1,
+			x1 - x, y1 - y, x2 - x1, y2 - y1,
+			layer, [=](const Rgba* fg, const Rgba* bg) {
+			Rgba fg2 = RgbaSum(
+				RgbaMult(*fg, 256 - blend.a),
+				RgbaMult(blend, blend.a)
+			);
+			Ui32 a = opacity == 0xff ? fg->a : Ui32(fg->a) * Ui32(opacity) >> 8;
+			Rgba result = RgbaSum(
+				RgbaMult(fg2, a),
+				RgbaMult(*bg, 256 - a)
+			);
+			result.a = Ui8(a + (Ui32(bg->a) * (256 - a) >> 8));
+			return result;
+		});
+	}
+
+	// Makes given rectangle of `layer' transparent
+	void LayerClear(Sprite layer, const Si32 x, const Si32 y, const Si32 width, const Si32 height)
+	{
+		FilterFillColor(Rgba(Ui32(0)), x, y, width, height,
+			layer, [](const Rgba* color, const Rgba*) {
+			return *color;
+		});
+	}
+
+	// Draws given rectangle of premultiplied `layer' over the same rectangle of `to_sprite'
+	void LayerComposite(Sprite layer, const Si32 x, const Si32 y, const Si32 width, const Si32 height, Sprite to_sprite)
+	{
+		FilterDraw(layer, x, y, width, height,
+			x, y, width, height,
+			to_sprite, [](const Rgba* fg, const Rgba* bg) {
+			return RgbaSum(*fg, RgbaMult(*bg, 256 - fg->a));
+		});
+	}
+
+	////////////////////////////////////////////////////////////////////////////////////////////////
+
 	void FilterBrightness(Sprite sprite, Ui8 alpha)
 	{
 		FilterFillColor(Rgba(), 0, 0, sprite.Width(), sprite.Height(),
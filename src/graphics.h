@@ -54,6 +54,12 @@ namespace pilecode {
 	void AlphaDrawAndBlend2(Sprite sprite, const Si32 to_x, const Si32 to_y, Rgba blend1, Rgba blend2);
 	void AlphaDrawAndBlend2(Sprite sprite, const Si32 to_x, const Si32 to_y, Sprite to_sprite, Rgba blend1, Rgba blend2);
 
+	// premultiplied alpha layers (see ViewPort::DrawLayer)
+	void LayerDraw(Sprite sprite, const Si32 to_x, const Si32 to_y, Sprite layer, Vec2Si32 lo, Vec2Si32 hi,
+		Rgba blend, Ui8 opacity = 0xff);
+	void LayerClear(Sprite layer, const Si32 x, const Si32 y, const Si32 width, const Si32 height);
+	void LayerComposite(Sprite layer, const Si32 x, const Si32 y, const Si32 width, const Si32 height, Sprite to_sprite);
+
     void FilterBrightness(Sprite sprite, Ui8 alpha);
 	void FilterSB(Sprite sprite, float saturation, float brightness);
 
@@ -143,8 +143,7 @@ namespace pilecode {
 				world->AddPlatform(plat2);
 				world->AddPlatform(plat3);
 
-				Robot* r = new Robot(world, Vec3Si32(0, 0, 0));
-				world->AddRobot(r);
+				world->AddRobot(Robot(world, Vec3Si32(0, 0, 0)));
 
 				world->AllowLetter(kLtUp);
 				world->AllowLetter(kLtRight);
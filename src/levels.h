@@ -22,8 +22,6 @@
 
 #pragma once
 
-#include "defs.h"
-
 #include "pilecode.h"
 
 namespace pilecode {
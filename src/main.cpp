@@ -25,88 +25,14 @@
 #include "pilecode.h"
 #include "data.h"
 #include "levels.h"
+#include "profile.h"
 
 #include <functional>
-#include <fstream>
 
 using namespace arctic;  // NOLINT
 using namespace arctic::easy;  // NOLINT
 using namespace pilecode; // NOLINT
 
-class PlayerProfile {
-public:
-	World* GetSavedWorld(int level)
-	{
-		if (IsLevelAvailable(level)) {
-			return level_[level]->Clone();
-		}
-		else {
-			return nullptr;
-		}
-	}
-
-	void UpdateLevel(int level, World* world)
-	{
-		if (level < level_.size()) {
-			level_[level] = std::shared_ptr<World>(world);
-		}
-		SaveToDisk();
-	}
-
-	void AddLevel(int level, World* world)
-	{
-		if (level == level_.size()) {
-			level_.emplace_back(world);
-		}
-		SaveToDisk();
-	}
-
-	void SaveTo(std::ostream& s) const
-	{
-		Save<size_t>(s, level_.size());
-		for (const auto& l : level_) {
-			l->SaveTo(s);
-		}
-	}
-
-	void LoadFrom(std::istream& s)
-	{
-		size_t levels;
-		Load<size_t>(s, levels);
-		level_.resize(levels);
-		for (auto& l : level_) {
-			l.reset(new World());
-			l->LoadFrom(s);
-		}
-	}
-
-	void SaveToDisk() const
-	{
-		std::ofstream ofs("profile.sav");
-		SaveTo(ofs);
-	}
-
-	void LoadFromDisk()
-	{
-		std::ifstream ifs("profile.sav");
-		if (ifs.good()) {
-			LoadFrom(ifs);
-		}
-	}
-
-	bool IsLevelAvailable(int level) const
-	{
-		return (size_t)level < level_.size();
-	}
-
-	int LastAvailableLevel() const
-	{
-		return int(level_.empty() ? 0 : level_.size() - 1);
-	}
-private:
-	std::vector<std::shared_ptr<World>> level_;
-};
-
 PlayerProfile g_profile;
 
 class IScene {
@@ -376,4 +302,7 @@ void EasyMain()
 		delete scene;
 		scene = nextScene;
 	}
+
+	// do not rely on order of destruction of globals to write last saves
+	g_profile.Flush();
 }
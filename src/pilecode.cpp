@@ -22,156 +22,85 @@
 
 #include "pilecode.h"
 
-#include "data.h"
-#include "graphics.h"
-#include "ui.h"
-
-#include "engine/arctic_math.h"
-
-#include <sstream>
-#include <unordered_map>
+#include <cstdlib>
 
 namespace pilecode {
 
-	Si32 Pos::dx = 14 * 4;
-	Si32 Pos::dy = 7 * 4;
-	Si32 Pos::dz = 25 * 4;
-
-	Shadow::Shadow()
-	{
-		for (bool& v : ceiling_) {
-			v = false;
-		}
-	}
-
-	Shadow::Shadow(World* world, Vec3Si32 w)
-	{
-		for (Si32 dx = -1; dx <= 1; dx++) {
-			for (Si32 dy = -1; dy <= 1; dy++) {
-				ceiling(dx, dy) = world->At(w + Vec3Si32(dx, dy, 1));
-			}
-		}
-	}
-
-	bool& Shadow::ceiling(Si32 dx, Si32 dy)
-	{
-		// transform ranges: [-1, 0, 1] ---> [0, 1, 2]
-		dx++;
-		dy++;
-		return ceiling_[dy * 3 + dx];
-	}
-
-	bool Shadow::ceiling(Si32 dx, Si32 dy) const
-	{
-		// transform ranges: [-1, 0, 1] ---> [0, 1, 2]
-		dx++;
-		dy++;
-		return ceiling_[dy * 3 + dx];
-	}
+	// Saved world is a container: magic, version, payload size and payload
+	// Payload fields are little-endian varints, so saves do not depend on platform
+	static const char kWorldMagic[4] = { 'P', 'C', 'W', 'D' };
+	static const Ui32 kWorldVersion = 1;
+	static const Ui64 kMaxSaveCells = 1 << 24; // sanity limit on world and platform size
+	static const size_t kMaxSaveBytes = 1 << 28; // sanity limit on saved world read from stream
 
-	void Tile::Draw(ViewPort* vp, Si32 wx, Si32 wy, Si32 wz, Si32 color)
+	// splitmix64 finalizer
+	static Ui64 HashMix(Ui64 x)
 	{
-		// tile brick
-		if (type_ != kTlNone) {
-			Sprite* sprite = vp->world()->params().data().TileSprite(color, type_);
-			vp->Draw(sprite, wx, wy, wz, 1, Vec2Si32(0, 0))
-				.Alpha();
-		}
-
-		// output
-		if (output_ != kLtSpace) {
-			Sprite* sprite = output_ == letter_ ?
-				&image::g_letter_output_filled[output_] :
-				&image::g_letter_output[output_];
-			vp->Draw(sprite, wx, wy, wz, 1)
-				.Alpha()
-				.PassEventThrough();
-		}
-
-		// letter
-		if (letter_ != kLtSpace) {
-			vp->Draw(&image::g_letter[letter_], wx, wy, wz, 1, Vec2Si32(0, 0))
-				.Alpha()
-				.PassEventThrough();
-		}
-
-		// shadow
-		if (type_ != kTlNone) {
-			vp->DrawShadow(wx, wy, wz, 1);
-		}
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
 	}
 
 	Letter Tile::ReadLetter()
 	{
-		touched_ = true;
+		set_field(kTouchedShift, 1, 1);
 		return letter();
 	}
 
 	void Tile::WriteLetter(Letter letter)
 	{
-		touched_ = true;
+		set_field(kTouchedShift, 1, 1);
 		set_letter(letter);
 	}
 
 	bool Tile::IsMovable() const
 	{
-		return type_ != kTlNone;
+		return type() != kTlNone;
 	}
 
 	bool Tile::IsModifiable() const
 	{
-		return type_ == kTlBrick;
+		return type() == kTlBrick;
 	}
 
-	void Tile::SaveTo(std::ostream& s) const
+	// Tile is saved as code: type | touched << 2 | letter << 3 | output << 8
+	void Tile::SaveTo(BinaryWriter& s) const
 	{
-		Save(s, type_);
-		Save(s, letter_);
-		Save(s, touched_);
-		Save(s, output_);
+		s.WriteVar(Ui64(type()) | (Ui64(touched()) << 2) | (Ui64(letter()) << 3) | (Ui64(output()) << 8));
 	}
 
-	void Tile::LoadFrom(std::istream& s)
+	bool Tile::LoadFrom(BinaryReader& s)
 	{
-		Load(s, type_);
-		Load(s, letter_);
-		Load(s, touched_);
-		Load(s, output_);
-	}
-
-	WorldData::WorldData(size_t colors)
-	{
-		tileSprite_.resize(colors);
-		for (Si32 wz = 0; wz < colors; wz++) {
-			auto& ts = tileSprite_[wz];
-			ts.resize(kTlMax);
-			float alpha = float(wz) / (colors - 1);
-			for (Si32 i = 0; i < kTlMax; i++) {
-				TileType t = TileType(i);
-				Sprite& src = image::g_tile[t];
-				Sprite& dst = ts[i];
-				dst.Create(src.Width(), src.Height());
-				Rgba* srcIt0 = src.RgbaData();
-				Rgba* dstIt0 = dst.RgbaData();
-				for (Si32 y = 0; y < src.Height(); srcIt0 += src.StridePixels(), dstIt0 += dst.StridePixels(), y++) {
-					Rgba* srcIt = srcIt0;
-					Rgba* dstIt = dstIt0;
-					for (Si32 x = 0; x < src.Width(); srcIt++, dstIt++, x++) {
-						*dstIt = *srcIt;
-						Si16 gdelta = Si16(dstIt->g * alpha);
-						Si16 bdelta = Si16(dstIt->b * alpha);
-						dstIt->g += bdelta - gdelta;
-						dstIt->b += gdelta - bdelta;
-					}
-				}
-			}
+		Ui64 code = s.ReadVar();
+		Ui64 type = code & 0x3;
+		Ui64 letter = (code >> 3) & 0x1f;
+		Ui64 output = (code >> 8) & 0x1f;
+		if (s.failed() || (code >> 13) || type >= kTlMax || letter >= kLtMax || output >= kLtMax) {
+			return false;
 		}
+		set_type(TileType(type));
+		set_letter(Letter(letter));
+		set_field(kTouchedShift, 1, (code >> 2) & 1);
+		set_output(Letter(output));
+		return true;
 	}
 
-	Sprite* WorldData::TileSprite(Si32 color, TileType type)
+	// Legacy format: type, letter, touched and output as raw enums and bool
+	void Tile::LoadLegacy(std::istream& s)
 	{
-		color = color % tileSprite_.size();
-		return &tileSprite_[color][type];
+		TileType type;
+		Letter letter;
+		bool touched;
+		Letter output;
+		Load(s, type);
+		Load(s, letter);
+		Load(s, touched);
+		Load(s, output);
+		set_type(type);
+		set_letter(letter);
+		set_field(kTouchedShift, 1, touched);
+		set_output(output);
 	}
 
 	WorldParams::WorldParams()
@@ -190,23 +119,47 @@ namespace pilecode {
 	{
 		xysize_ = xsize_ * ysize_;
 		xyzsize_ = xsize_ * ysize_ * zsize_;
-		data_.reset(new WorldData(colors_));
+		data_ = std::make_shared<std::shared_ptr<WorldData>>();
+	}
+
+	void WorldParams::SaveTo(BinaryWriter& s) const
+	{
+		s.WriteVar(Ui32(xsize_));
+		s.WriteVar(Ui32(ysize_));
+		s.WriteVar(Ui32(zsize_));
+		s.WriteVar(Ui32(colors_));
 	}
 
-	void WorldParams::SaveTo(std::ostream& s) const
+	bool WorldParams::LoadFrom(BinaryReader& s)
 	{
-		Save(s, xsize_);
-		Save(s, ysize_);
-		Save(s, zsize_);
-		Save(s, colors_);
+		Ui64 xsize = s.ReadVar();
+		Ui64 ysize = s.ReadVar();
+		Ui64 zsize = s.ReadVar();
+		Ui64 colors = s.ReadVar();
+		if (s.failed() || !xsize || !ysize || !zsize || colors > 0xff
+			|| xsize > kMaxSaveCells || ysize > kMaxSaveCells || zsize > kMaxSaveCells
+			|| xsize * ysize * zsize > kMaxSaveCells) {
+			return false;
+		}
+		xsize_ = Si32(xsize);
+		ysize_ = Si32(ysize);
+		zsize_ = Si32(zsize);
+		colors_ = Si32(colors);
+		Init();
+		return true;
 	}
 
-	void WorldParams::LoadFrom(std::istream& s)
+	void WorldParams::LoadLegacy(std::istream& s)
 	{
 		Load(s, xsize_);
 		Load(s, ysize_);
 		Load(s, zsize_);
 		Load(s, colors_);
+		if (xsize_ < 0 || ysize_ < 0 || zsize_ < 0
+			|| Ui64(xsize_) * Ui64(ysize_) * Ui64(zsize_) > kMaxSaveCells) {
+			xsize_ = ysize_ = zsize_ = 0;
+			s.setstate(std::ios::failbit);
+		}
 		Init();
 	}
 
@@ -228,9 +181,9 @@ namespace pilecode {
 			h_++;
 		}
 
-		tiles_.resize(w_ * h_);
+		tiles_ = std::make_shared<std::vector<Tile>>(w_ * h_);
 
-		Tile* tile = &tiles_[0];
+		Tile* tile = tiles_->data();
 		for (auto& xdata : data) {
 			Tile* t = tile;
 			for (Si32 x : xdata) {
@@ -241,15 +194,24 @@ namespace pilecode {
 		}
 	}
 
-	void Platform::Draw(ViewPort * vp)
+	Platform::Platform(Si32 x, Si32 y, Si32 z, Si32 w, Si32 h, TileType type)
+		: x_(x), y_(y), z_(z), w_(w), h_(h)
+	{
+		Tile tile;
+		tile.set_type(type);
+		tiles_ = std::make_shared<std::vector<Tile>>(w_ * h_, tile);
+	}
+
+	// Ceilings depend only on geometry, so they are shared by clones
+	void Platform::IndexCeilings(const World* world)
 	{
-		Tile* tile = &tiles_[0];
-		for (Si32 iy = 0; iy < h_; iy++) {
-			for (Si32 ix = 0; ix < w_; ix++) {
-				tile->Draw(vp, WorldX(ix), WorldY(iy), z_, index());
-				tile++;
+		auto ceilings = std::make_shared<std::vector<Ui16>>(tiles_->size());
+		for (Si32 ry = 0; ry < h_; ry++) {
+			for (Si32 rx = 0; rx < w_; rx++) {
+				(*ceilings)[ry * w_ + rx] = world->Ceiling(ToWorld(rx, ry, 0));
 			}
 		}
+		ceilings_ = ceilings;
 	}
 
 	Platform* Platform::Clone() const
@@ -262,15 +224,18 @@ namespace pilecode {
 	{
 		if (Tile* tile = changable_tile(rx, ry)) {
 			if (tile->IsModifiable()) {
+				Tile before = *tile;
 				Letter prevLetter = tile->letter();
 				if (prevLetter != letter) {
 					tile->set_letter(letter);
+					LetterChanged(before, *tile);
 					return MakeResult(kRsOk, prevLetter);
 				}
 				else if (letter == kLtSpace) {
 					return MakeResult(kRsAlready, prevLetter);
 				}
 				tile->set_letter(kLtSpace);
+				LetterChanged(before, *tile);
 				return MakeResult(kRsUndone, prevLetter);
 			}
 			return MakeResult(kRsForbidden);
@@ -278,10 +243,14 @@ namespace pilecode {
 		return MakeResult(kRsNotFound);
 	}
 
+	// Copies tiles shared with clones, so pointer to tile should not be kept
 	Tile* Platform::changable_tile(Si32 rx, Si32 ry)
 	{
 		if (rx >= 0 && rx < w_ && ry >= 0 && ry < h_) {
-			return &tiles_[ry * w_ + rx];
+			if (tiles_.use_count() > 1) {
+				tiles_ = std::make_shared<std::vector<Tile>>(*tiles_);
+			}
+			return &(*tiles_)[ry * w_ + rx];
 		} else {
 			return nullptr;
 		}
@@ -290,7 +259,7 @@ namespace pilecode {
 	const Tile* Platform::get_tile(Si32 rx, Si32 ry) const
 	{
 		if (rx >= 0 && rx < w_ && ry >= 0 && ry < h_) {
-			return &tiles_[ry * w_ + rx];
+			return &(*tiles_)[ry * w_ + rx];
 		}
 		else {
 			return Tile::none();
@@ -312,7 +281,9 @@ namespace pilecode {
 	{
 		if (Tile* tile = changable_tile(rx, ry)) {
 			if (tile->IsMovable()) {
+				Tile before = *tile;
 				tile->WriteLetter(letter);
+				LetterChanged(before, *tile);
 				return true;
 			}
 			else {
@@ -324,33 +295,35 @@ namespace pilecode {
 		}
 	}
 
-	bool Platform::IsOutputCorrect()
+	// Should be called after output of any tile is changed
+	void Platform::CountMismatches()
 	{
-		for (Tile& tile : tiles_) {
-			if (tile.output() != kLtSpace) {
-				if (tile.letter() != tile.output()) {
-					return false;
-				}
-			}
+		mismatches_ = 0;
+		for (const Tile& tile : *tiles_) {
+			mismatches_ += tile.IsOutputMismatch();
 		}
-		return true;
 	}
 
-	Tile* Platform::At(Vec3Si32 w)
+	// Should be called after letter of tile is changed through changable_tile()
+	void Platform::LetterChanged(const Tile& before, const Tile& after)
+	{
+		mismatches_ += Si32(after.IsOutputMismatch()) - Si32(before.IsOutputMismatch());
+	}
+
+	const Tile* Platform::At(Vec3Si32 w) const
 	{
 		if (w.z == z_) {
-			if (Tile* tile = changable_tile(PlatformX(w.x), PlatformY(w.y))) {
-				if (tile->type() != kTlNone) {
-					return tile;
-				}
+			const Tile* tile = get_tile(PlatformX(w.x), PlatformY(w.y));
+			if (tile->type() != kTlNone) {
+				return tile;
 			}
 		}
 		return nullptr;
 	}
 
-	void Platform::ForEachTile(std::function<void(Vec3Si32, Tile*)> func)
+	void Platform::ForEachTile(std::function<void(Vec3Si32, const Tile*)> func) const
 	{
-		Tile* tile = &tiles_[0];
+		const Tile* tile = tiles_->data();
 		Vec3Si32 w(x_, y_, z_);
 		for (Si32 ry = 0; ry < h_; ry++, w.y++) {
 			w.x = x_;
@@ -362,21 +335,57 @@ namespace pilecode {
 		}
 	}
 
-	void Platform::SaveTo(std::ostream& s) const
+	// Tiles are run-length encoded as (run, tile) pairs in row-major order
+	void Platform::SaveTo(BinaryWriter& s) const
+	{
+		s.WriteSVar(index_);
+		s.WriteSVar(x_);
+		s.WriteSVar(y_);
+		s.WriteSVar(z_);
+		s.WriteVar(Ui32(w_));
+		s.WriteVar(Ui32(h_));
+		SaveTiles(s);
+	}
+
+	void Platform::SaveTiles(BinaryWriter& s) const
+	{
+		for (auto i = tiles_->begin(); i != tiles_->end(); ) {
+			auto j = std::find_if(i, tiles_->end(), [&](const Tile& tile) { return tile != *i; });
+			s.WriteVar(Ui64(j - i));
+			i->SaveTo(s);
+			i = j;
+		}
+	}
+
+	bool Platform::LoadFrom(BinaryReader& s)
 	{
-		Save(s, index_);
-		Save(s, x_);
-		Save(s, y_);
-		Save(s, z_);
-		Save(s, w_);
-		Save(s, h_);
-		Save<size_t>(s, tiles_.size());
-		for (const auto& tile : tiles_) {
-			tile.SaveTo(s);
+		index_ = Si32(s.ReadSVar());
+		x_ = Si32(s.ReadSVar());
+		y_ = Si32(s.ReadSVar());
+		z_ = Si32(s.ReadSVar());
+		Ui64 w = s.ReadVar();
+		Ui64 h = s.ReadVar();
+		if (s.failed() || w > kMaxSaveCells || h > kMaxSaveCells || w * h > kMaxSaveCells) {
+			return false;
+		}
+		w_ = Si32(w);
+		h_ = Si32(h);
+		size_t size = size_t(w * h);
+		tiles_ = std::make_shared<std::vector<Tile>>();
+		tiles_->reserve(size);
+		while (tiles_->size() < size) {
+			Ui64 run = s.ReadVar();
+			Tile tile;
+			if (!tile.LoadFrom(s) || run == 0 || run > size - tiles_->size()) {
+				return false;
+			}
+			tiles_->insert(tiles_->end(), size_t(run), tile);
 		}
+		CountMismatches();
+		return true;
 	}
 
-	void Platform::LoadFrom(std::istream& s)
+	void Platform::LoadLegacy(std::istream& s)
 	{
 		Load(s, index_);
 		Load(s, x_);
@@ -386,10 +395,15 @@ namespace pilecode {
 		Load(s, h_);
 		size_t tiles;
 		Load<size_t>(s, tiles);
-		tiles_.resize(tiles);
-		for (auto& tile : tiles_) {
-			tile.LoadFrom(s);
+		if (!s || w_ < 0 || h_ < 0 || tiles > kMaxSaveCells || tiles != size_t(w_) * size_t(h_)) {
+			s.setstate(std::ios::failbit);
+			return;
+		}
+		tiles_ = std::make_shared<std::vector<Tile>>(tiles);
+		for (auto& tile : *tiles_) {
+			tile.LoadLegacy(s);
 		}
+		CountMismatches();
 	}
 
 	Robot::Robot()
@@ -415,40 +429,6 @@ namespace pilecode {
 		py_ = y_ = p->PlatformY(w.y);
 	}
 
-	void Robot::CalculatePosition(ViewPort* vp, Vec3Si32& w, Vec2Si32& off, Si32& body_off_y) const
-	{
-		Platform* p = vp->world()->platform(platform_);
-		w = p->ToWorld(px_, py_, 0);
-
-		off = Pos::ToScreen(d_pos());
-		off.x = Si32(off.x * vp->progress());
-		off.y = Si32(off.y * vp->progress());
-
-		body_off_y = (Si32)round(4.0 * sin((vp->progress() + (seed_ % 1000) / 1000.0) * 2.0 * M_PI));
-	}
-
-	void Robot::Draw(ViewPort* vp)
-	{
-		Vec3Si32 w;
-		Vec2Si32 off;
-		Si32 body_off_y;
-		CalculatePosition(vp, w, off, body_off_y);
-
-		vp->Draw(&image::g_robotShadow, w, 2, off)
-			.Alpha()
-			.PassEventThrough();
-		vp->Draw(&image::g_robot, w, 2, Vec2Si32(off.x, off.y + body_off_y))
-			.Alpha()
-			.Interactive(0, this);
-
-		if (reg_ != kLtSpace) {
-			vp->Draw(&image::g_letter[reg_], w, 2,
-				Vec2Si32(off.x, off.y + body_off_y + g_yrobotReg))
-				.Alpha()
-				.PassEventThrough();
-		}
-	}
-
 	void Robot::SimulateExec(World* world)
 	{
 		if (executing_ > 0) {
@@ -458,62 +438,60 @@ namespace pilecode {
 		else {
 			// read command
 			Platform* p = world->platform(platform_);
-			if (Tile* cur_tile = p->changable_tile(x_, y_)) {
-				if (cur_tile->IsMovable()) {
-					Vec3Si32 w = p->ToWorld(x_, y_, 0);
-					Vec3Si32 wu = w;
-					wu.z++;
-
-					switch (cur_tile->ReadLetter()) {
-                    default: // unknown letter is equivalent to space
-					case kLtSpace:
-						blocked_ = false;
-						break; // just keep moving
-					case kLtUp:
-						dir_ = kDirUp;
-						blocked_ = false;
-						break;
-					case kLtDown:
-						dir_ = kDirDown;
-						blocked_ = false;
-						break;
-					case kLtRight:
-						dir_ = kDirRight;
-						blocked_ = false;
-						break;
-					case kLtLeft:
-						dir_ = kDirLeft;
-						blocked_ = false;
-						break;
-					case kLtInput: {
-						Letter letter;
-						blocked_ = !world->ReadLetter(wu, letter);
+			if (p->get_tile(x_, y_)->IsMovable()) {
+				Vec3Si32 w = p->ToWorld(x_, y_, 0);
+				Vec3Si32 wu = w;
+				wu.z++;
+
+				switch (world->ReadCommand(platform_, w)) {
+				default: // unknown letter is equivalent to space
+				case kLtSpace:
+					blocked_ = false;
+					break; // just keep moving
+				case kLtUp:
+					dir_ = kDirUp;
+					blocked_ = false;
+					break;
+				case kLtDown:
+					dir_ = kDirDown;
+					blocked_ = false;
+					break;
+				case kLtRight:
+					dir_ = kDirRight;
+					blocked_ = false;
+					break;
+				case kLtLeft:
+					dir_ = kDirLeft;
+					blocked_ = false;
+					break;
+				case kLtInput: {
+					Letter letter;
+					blocked_ = !world->ReadLetter(wu, letter);
+					if (!blocked_) {
+						executing_ = 1;
+						if (letter != kLtSpace) {
+							reg_ = letter;
+						}
+						if (WorldEvents* events = world->events()) {
+							events->OnRead(this, wu, letter);
+						}
+					}
+					break;
+				}
+				case kLtOutput:
+					if (reg_ != kLtSpace) {
+						blocked_ = !world->WriteLetter(wu, reg_);
 						if (!blocked_) {
 							executing_ = 1;
-							if (letter != kLtSpace) {
-								reg_ = letter;
+							if (WorldEvents* events = world->events()) {
+								events->OnWrite(this, wu, reg_);
 							}
-							sfx::g_read.Play();
 						}
-						break;
 					}
-					case kLtOutput:
-						if (reg_ != kLtSpace) {
-							blocked_ = !world->WriteLetter(wu, reg_);
-							if (!blocked_) {
-								executing_ = 1;
-								sfx::g_write.Play();
-							}
-						}
-						else {
-							blocked_ = false;
-						}
-						break;
+					else {
+						blocked_ = false;
 					}
-				}
-				else {
-					dir_ = kDirHalt;
-					blocked_ = true;
+					break;
 				}
 			}
 			else {
@@ -523,74 +501,84 @@ namespace pilecode {
 		}
 	}
 
-	void Robot::PrepareMove(World* world)
-	{
-		Platform* p = world->platform(platform_);
-		curr_ = p->ToWorld(x_, y_, 0);
-		if (!blocked_ && !executing_ && dir_ != kDirHalt) {
-			Vec2Si32 delta = dir_delta();
-			Vec3Si32 next = p->ToWorld(x_ + delta.x, y_ + delta.y, 0);
-			next_ = world->IsMovable(next) ? next : curr_;
-		}
-		else {
-			next_ = curr_;
-		}
-	}
-	
-	size_t Robot::ResolveMove(Robot* r1, Robot* r2)
-	{
-		// front-to-front deadlock -- block both
-		if (r1->next_ == r2->curr_ && r1->curr_ == r2->next_) {
-			r1->StopMove();
-			r2->StopMove();
-			return 2;
-		}
-
-		if (r1->next_ == r2->next_) {
-			// movement into stopped robot
-			Vec3Si32 d1 = r1->next_ - r1->curr_;
-			if (d1.x == 0 && d1.y == 0) {
-				r2->StopMove();
-				return 1;
-			}
-
-			// movement into stopped robot
-			Vec3Si32 d2 = r2->next_ - r2->curr_;
-			if (d2.x == 0 && d2.y == 0) {
-				r1->StopMove();
-				return 1;
-			}
-
-			// use priority
-			(r1->priority() < r2->priority() ? r1 : r2)->StopMove();
-			return 1;
-		}
-
-		return 0;
-	}
-
-	// should be called after PrepareMove() and before SimulateMove()
-	void Robot::StopMove()
-	{
-		next_ = curr_;
-	}
-
-	void Robot::SimulateMove(World* world)
+	void Robot::SimulateMove(World* world, Vec3Si32 next)
 	{
 		// choose platform robot is on
-		Platform* p = world->FindPlatform(next_);
+		Platform* p = world->FindPlatform(next);
 		platform_ = p->index();
 
 		// propagate robot
 		px_ = x_;
 		py_ = y_;
-		x_ = p->PlatformX(next_.x);
-		y_ = p->PlatformY(next_.y);
+		x_ = p->PlatformX(next.x);
+		y_ = p->PlatformY(next.y);
+	}
+
+	// Returns true iff next step would not change robot until letter on its tile is changed,
+	// so it does not need to be simulated (must agree with SimulateExec() and World::PrepareMoves())
+	bool Robot::IsIdle(const World* world) const
+	{
+		if (executing_ > 0 || x_ != px_ || y_ != py_) {
+			return false;
+		}
+		Platform* p = world->platform(platform_);
+		const Tile* tile = p->get_tile(x_, y_);
+		if (!tile->IsMovable()) {
+			return dir_ == kDirHalt && blocked_;
+		}
+		if (!tile->touched()) {
+			return false;
+		}
+		if (blocked_) {
+			// Whether cell above can be read or written depends only on tile types,
+			// and changing them wakes all robots, so failed read or write just repeats
+			Vec3Si32 wu = p->ToWorld(x_, y_, 0);
+			wu.z++;
+			switch (tile->letter()) {
+			case kLtInput:
+				return !world->IsReadable(wu);
+			case kLtOutput:
+				return reg_ != kLtSpace && !world->IsWritable(wu);
+			default:
+				return false; // other letters unblock robot
+			}
+		}
+		switch (tile->letter()) {
+		case kLtUp:
+			if (dir_ != kDirUp) return false;
+			break;
+		case kLtDown:
+			if (dir_ != kDirDown) return false;
+			break;
+		case kLtRight:
+			if (dir_ != kDirRight) return false;
+			break;
+		case kLtLeft:
+			if (dir_ != kDirLeft) return false;
+			break;
+		case kLtInput:
+			return false; // reads other tile or blocks
+		case kLtOutput:
+			if (reg_ != kLtSpace) return false; // writes other tile
+			break;
+		default:
+			break;
+		}
+		if (dir_ == kDirHalt) {
+			return true;
+		}
+		Vec2Si32 delta = dir_delta();
+		return !world->IsMovable(p->ToWorld(x_ + delta.x, y_ + delta.y, 0));
 	}
 
-	Robot* Robot::Clone() const
+	// Moves robot straight ahead as `steps' steps over empty tiles would do
+	void Robot::Cruise(Si32 steps)
 	{
-		return new Robot(*this);	
+		Vec2Si32 delta = dir_delta();
+		x_ += steps * delta.x;
+		y_ += steps * delta.y;
+		px_ = x_ - delta.x;
+		py_ = y_ - delta.y;
 	}
 
 	Vec2Si32 Robot::d_pos() const
@@ -614,22 +602,67 @@ namespace pilecode {
 		}
     }
 
-	void Robot::SaveTo(std::ostream& s) const
-	{
-		Save(s, seed_);
-		Save(s, priority_);
-		Save(s, platform_);
-		Save(s, x_);
-		Save(s, y_);
-		Save(s, px_);
-		Save(s, py_);
-		Save(s, dir_);
-		Save(s, reg_);
-		Save(s, blocked_);
-		Save(s, executing_);
+	bool Robot::operator==(const Robot& other) const
+	{
+		return seed_ == other.seed_
+			&& priority_ == other.priority_
+			&& platform_ == other.platform_
+			&& x_ == other.x_
+			&& y_ == other.y_
+			&& px_ == other.px_
+			&& py_ == other.py_
+			&& dir_ == other.dir_
+			&& reg_ == other.reg_
+			&& blocked_ == other.blocked_
+			&& executing_ == other.executing_;
+	}
+
+	// Hashes state that affects simulation (previous position is for rendering only)
+	Ui64 Robot::StateHash() const
+	{
+		Ui64 h = HashMix(Ui64(Ui32(x_)) | (Ui64(Ui32(y_)) << 32));
+		h = HashMix(h ^ (Ui64(Ui32(platform_)) | (Ui64(Ui32(executing_)) << 32)));
+		return HashMix(h ^ (Ui64(dir_) | (Ui64(reg_) << 8) | (Ui64(blocked_) << 16)));
+	}
+
+	void Robot::SaveTo(BinaryWriter& s) const
+	{
+		s.WriteSVar(seed_);
+		s.WriteSVar(priority_);
+		s.WriteSVar(platform_);
+		s.WriteSVar(x_);
+		s.WriteSVar(y_);
+		s.WriteSVar(px_);
+		s.WriteSVar(py_);
+		s.WriteU8(Ui8(dir_));
+		s.WriteU8(Ui8(reg_));
+		s.WriteU8(blocked_);
+		s.WriteSVar(executing_);
+	}
+
+	bool Robot::LoadFrom(BinaryReader& s)
+	{
+		seed_ = Si32(s.ReadSVar());
+		priority_ = Si32(s.ReadSVar());
+		platform_ = Si32(s.ReadSVar());
+		x_ = Si32(s.ReadSVar());
+		y_ = Si32(s.ReadSVar());
+		px_ = Si32(s.ReadSVar());
+		py_ = Si32(s.ReadSVar());
+		Ui8 dir = s.ReadU8();
+		Ui8 reg = s.ReadU8();
+		Ui8 blocked = s.ReadU8();
+		executing_ = Si32(s.ReadSVar());
+		if (s.failed() || dir > kDirDown || reg >= kLtMax || blocked > 1) {
+			return false;
+		}
+		dir_ = Direction(dir);
+		reg_ = Letter(reg);
+		blocked_ = blocked != 0;
+		return true;
 	}
 
-	void Robot::LoadFrom(std::istream& s)
+	void Robot::LoadLegacy(std::istream& s)
 	{
 		Load(s, seed_);
 		Load(s, priority_);
@@ -642,6 +675,11 @@ namespace pilecode {
 		Load(s, reg_);
 		Load(s, blocked_);
 		Load(s, executing_);
+		if (Si32(dir_) < kDirHalt || Si32(dir_) > kDirDown || Si32(reg_) < 0 || Si32(reg_) >= kLtMax) {
+			dir_ = kDirHalt;
+			reg_ = kLtSpace;
+			s.setstate(std::ios::failbit); // damaged, would index out of tables
+		}
 	}
 
 	World::World()
@@ -656,38 +694,41 @@ namespace pilecode {
 			isLetterAllowed_[i] = false;
 		}
 		AllowLetter(kLtSpace);
-	}
-
-	void World::Draw(ViewPort* vp)
-	{
-		for (auto& p : platform_) {
-			p->Draw(vp);
-		}
-		for (auto& r : robot_) {
-			r->Draw(vp);
-		}
+		ResetIndex();
 	}
 
 	void World::AddPlatform(Platform* platform)
 	{
 		platform->set_index((Si32)platform_.size());
 		platform_.emplace_back(platform);
+		platform->CountMismatches();
+		for (const auto& p : platform_) {
+			p->ResetCeilings(); // new platform may cover the others
+		}
+		IndexPlatform(platform);
+		HashPlatform(platform);
+		OnEdit();
 	}
 
-	void World::AddRobot(Robot * robot)
+	void World::AddRobot(const Robot& robot)
 	{
-		robot_.emplace_back(robot);
+		robot_.push_back(robot);
+		hash_ ^= RobotHash(Si32(robot_.size() - 1), robot_.back());
+		OnEdit();
 	}
 
 	// returns previous letter on changed tile iff successful
 	Result<Letter> World::SetLetter(Vec3Si32 w, Letter letter)
 	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->cover != -1) {
+				Platform* p = platform_[cell->cover].get();
+				Tile* tile = CoverTile(w);
+				hash_ ^= TileHash(cell->cover, w, *tile);
 				auto res = p->SetLetter(this, p->PlatformX(w.x), p->PlatformY(w.y), letter);
-				if (res.status != kRsNotFound) {
-					return res;
-				}
+				hash_ ^= TileHash(cell->cover, w, *tile);
+				OnEdit();
+				return res;
 			}
 		}
 		return MakeResult(kRsNotFound);
@@ -701,27 +742,32 @@ namespace pilecode {
 
 			// try find robot to remove
 			for (auto i = robot_.begin(), e = robot_.end(); i != e; ++i) {
-				Robot* r = i->get();
-				if (r->platform() == p->index() && rx == r->x() && ry == r->y()) {
+				if (i->platform() == p->index() && rx == i->x() && ry == i->y()) {
 					robot_.erase(i);
+					Rehash(); // robots are hashed with their indices
+					OnEdit();
 					return;
 				}
 			}
 
 			// if no robot is under cursor - create one
-			Robot* clone = original.Clone();
-			clone->Place(this, w);
+			Robot clone = original;
+			clone.Place(this, w);
 			AddRobot(clone);
 		}
 	}
 
-	bool World::IsTouched(Vec3Si32 w)
+	bool World::IsTouched(Vec3Si32 w) const
 	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
-				if (p->get_tile(p->PlatformX(w.x), p->PlatformY(w.y))->touched()) {
-					return true;
-				}
+		// only covering and owning platforms' tiles are ever read or written
+		if (const Tile* tile = CoverTile(w)) {
+			if (tile->touched()) {
+				return true;
+			}
+		}
+		if (const Tile* tile = OwnerTile(w)) {
+			if (tile->touched()) {
+				return true;
 			}
 		}
 		return false;
@@ -739,641 +785,1259 @@ namespace pilecode {
 
 	void World::Simulate()
 	{
-		for (const auto& robot : robot_) {
-			robot->SimulateExec(this);
+		Ui64 prevHash = hash_;
+		if (journalLimit_) {
+			// forget undone steps
+			journal_.resize(journalStep_);
+			journalTiles_.resize(journalTile_);
+			journalRobots_.resize(journalRobot_);
 		}
-		for (const auto& robot : robot_) {
-			robot->PrepareMove(this);
+		bool recording = IsRecording();
+		if (recording) {
+			stepTiles_.clear();
+			stepRobots_.clear();
+		}
+		if (robotsBefore_.size() != robot_.size()) {
+			robotsBefore_ = robot_;
 		}
 
-		// Resolve movements until there are conflicts
-		size_t resolved;
-		do {
-			resolved = 0;
-			for (const auto& r1 : robot_) {
-				for (const auto& r2 : robot_) {
-					if (r1 != r2) {
-						resolved += Robot::ResolveMove(r1.get(), r2.get());
-					}
+		// Only awake robots are simulated, sleeping ones would not change (see Robot::IsIdle())
+		// Robots woken by robot `i' join this step if they come after it
+		for (size_t k = 0; k < active_.size(); k++) {
+			Si32 i = active_[k];
+			simulating_ = i;
+			robotsBefore_[i] = robot_[i];
+			robot_[i].SimulateExec(this);
+			heading_[i] = Ui8(robot_[i].heading());
+		}
+		simulating_ = -1;
+
+		PrepareMoves();
+		if (checkMoves_) {
+			reference_ = next_;
+			ResolveMovesPairwise(reference_);
+		}
+		if (referenceMoves_) {
+			ResolveMovesPairwise(next_);
+		}
+		else {
+			ResolveMoves();
+		}
+		if (checkMoves_ && next_ != reference_) {
+			moveMismatches_++;
+		}
+
+		// Every cell is left and entered by at most one robot, so flipping both is exact
+		for (Si32 i : active_) {
+			Robot& r = robot_[i];
+			if (next_[i] != cell_[i]) {
+				Vec3Si32 curr = platform_[r.platform()]->ToWorld(r.x(), r.y(), 0);
+				Vec2Si32 delta = r.dir_delta();
+				Vec3Si32 next(curr.x + delta.x, curr.y + delta.y, curr.z);
+				occupied_[curr.z].flip(curr.x, curr.y);
+				occupied_[next.z].flip(next.x, next.y);
+				r.SimulateMove(this, next);
+				cell_[i] = next_[i];
+			}
+			else {
+				r.SimulateStop();
+			}
+			// robots stuck in traffic are not changed by step and need not be rehashed
+			if (r != robotsBefore_[i]) {
+				hash_ ^= RobotHash(i, robotsBefore_[i]) ^ RobotHash(i, r);
+				if (recording) {
+					stepRobots_.push_back(RobotChange{i, robotsBefore_[i], r});
 				}
 			}
-		} while (resolved);
-
-		for (const auto& robot : robot_) {
-			robot->SimulateMove(this);
 		}
 		steps_++;
-	}
-
-	bool World::ReadLetter(Vec3Si32 w, Letter& letter)
-	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
-				if (p->ReadLetter(p->PlatformX(w.x), p->PlatformY(w.y), letter)) {
-					return true;
-				}
+		DetectLoop(prevHash);
+
+		// Put idle robots to sleep and wake robots whose tiles were changed
+		// Robot heading into movable cell is never idle (see Robot::IsIdle())
+		size_t awake = 0;
+		const Ui8* exits = exits_->data();
+		for (Si32 i : active_) {
+			if (simulateAll_ || ((exits[cell_[i]] >> heading_[i]) & 1) || !robot_[i].IsIdle(this) || !Sleep(i)) {
+				active_[awake++] = i;
 			}
 		}
-		return false;
-	}
-
-	bool World::WriteLetter(Vec3Si32 w, Letter letter)
-	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
-				if (p->WriteLetter(p->PlatformX(w.x), p->PlatformY(w.y), letter)) {
-					return true;
+		active_.resize(awake);
+		if (!woken_.empty()) {
+			for (Si32 i : woken_) {
+				if (sleep_[i] != -1) {
+					sleeper_[sleep_[i]] = -1;
+					sleep_[i] = -1;
+					active_.push_back(i);
 				}
 			}
+			woken_.clear();
+			std::sort(active_.begin(), active_.end());
+		}
+
+		if (journalLimit_) {
+			StepRecord record = {stepTiles_.size(), stepRobots_.size(), prevHash, hash_};
+			journalTiles_.insert(journalTiles_.end(), stepTiles_.begin(), stepTiles_.end());
+			journalRobots_.insert(journalRobots_.end(), stepRobots_.begin(), stepRobots_.end());
+			journal_.push_back(record);
+			journalStep_++;
+			journalTile_ += record.tiles;
+			journalRobot_ += record.robots;
+
+			// forget oldest steps to fit into memory limit
+			while (journalStep_ > 0 && journal_.size() * sizeof(StepRecord)
+				+ journalTiles_.size() * sizeof(TileChange)
+				+ journalRobots_.size() * sizeof(RobotChange) > journalLimit_)
+			{
+				const StepRecord& oldest = journal_.front();
+				journalTiles_.erase(journalTiles_.begin(), journalTiles_.begin() + oldest.tiles);
+				journalRobots_.erase(journalRobots_.begin(), journalRobots_.begin() + oldest.robots);
+				journalTile_ -= oldest.tiles;
+				journalRobot_ -= oldest.robots;
+				journal_.pop_front();
+				journalStep_--;
+			}
 		}
-		return false;
+		NotifyChanges();
 	}
 
-	bool World::IsMovable(Vec3Si32 w)
+	// Makes one step or jumps over up to `maxSteps' steps in which every robot
+	// just moves straight over empty tiles; returns number of steps made.
+	// Note that loop is detected only at jumps boundaries, possibly later and with multiple period.
+	// Jump is reported to listeners as one change of robots and clears undo journal
+	size_t World::Advance(size_t maxSteps)
 	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
-				if (Tile* tile = p->changable_tile(p->PlatformX(w.x), p->PlatformY(w.y))) {
-					return tile->IsMovable();
-				}
-			}
+		if (maxSteps == 0) {
+			return 0;
 		}
-		return false;
+		size_t steps = JumpLength(maxSteps);
+		if (steps > 1) {
+			Jump(steps);
+			return steps;
+		}
+		Simulate();
+		return 1;
 	}
 
-	World* World::Clone() const
+	// Returns number of steps that can be jumped over (0 if next step should be simulated)
+	size_t World::JumpLength(size_t maxSteps)
 	{
-		World* clone = new World(wparams_);
-		for (const auto& p : platform_) {
-			clone->AddPlatform(p->Clone());
+		// Avoid quadratic check of robot paths
+		const size_t kMaxJumpRobots = 32;
+		if (simulateAll_ || active_.empty() || active_.size() > kMaxJumpRobots) {
+			return 0;
 		}
-		for (const auto& r : robot_) {
-			clone->AddRobot(r->Clone());
+		if (runs_.size() != platform_.size()) {
+			runs_.resize(platform_.size());
 		}
-		for (Si32 i = 0; i < kLtMax; i++) {
-			clone->isLetterAllowed_[i] = isLetterAllowed_[i];
+
+		// Every awake robot should move over empty tiles
+		size_t steps = maxSteps;
+		for (Si32 i : active_) {
+			const Robot& r = robot_[i];
+			if (r.executing() || r.blocked() || r.dir() == Robot::kDirHalt) {
+				return 0;
+			}
+			Platform* p = platform_[r.platform()].get();
+			if (runs_[p->index()].empty()) {
+				IndexRuns(p->index());
+			}
+			steps = std::min<size_t>(steps, runs_[p->index()][(r.y() * p->w() + r.x()) * 4 + r.dir() - 1]);
+			if (steps < 2) {
+				return 0;
+			}
 		}
-		return clone;
-	}
 
-	Platform* World::FindPlatform(Vec3Si32 w)
-	{
-		for (const auto& p : platform_) {
-			if (p->WorldZ(0) == w.z) {
-				if (Tile* tile = p->changable_tile(p->PlatformX(w.x), p->PlatformY(w.y))) {
-					if (tile->type() != kTlNone) {
-						return p.get();
-					}
+		// Robots should not meet on their paths (axis-aligned paths intersect iff their bounds do)
+		for (size_t a = 0; a < active_.size(); a++) {
+			const Robot& ra = robot_[active_[a]];
+			Platform* pa = platform_[ra.platform()].get();
+			Vec2Si32 da = ra.dir_delta();
+			da.x *= Si32(steps);
+			da.y *= Si32(steps);
+			Vec3Si32 a0 = pa->ToWorld(ra.x(), ra.y(), 0);
+			for (size_t b = a + 1; b < active_.size(); b++) {
+				const Robot& rb = robot_[active_[b]];
+				Platform* pb = platform_[rb.platform()].get();
+				Vec2Si32 db = rb.dir_delta();
+				db.x *= Si32(steps);
+				db.y *= Si32(steps);
+				Vec3Si32 b0 = pb->ToWorld(rb.x(), rb.y(), 0);
+				if (a0.z == b0.z
+					&& std::min(a0.x, a0.x + da.x) <= std::max(b0.x, b0.x + db.x)
+					&& std::min(b0.x, b0.x + db.x) <= std::max(a0.x, a0.x + da.x)
+					&& std::min(a0.y, a0.y + da.y) <= std::max(b0.y, b0.y + db.y)
+					&& std::min(b0.y, b0.y + db.y) <= std::max(a0.y, a0.y + da.y))
+				{
+					return 0;
 				}
 			}
+
+			// nor run into robots standing on them
+			Vec2Si32 d = ra.dir_delta();
+			if (IsRobotIn(a0 + Vec3Si32(d.x, d.y, 0), a0 + Vec3Si32(da.x, da.y, 0))) {
+				return 0;
+			}
 		}
-		return nullptr;
+		return steps;
 	}
 
-	bool World::IsOutputCorrect()
+	// Gives the same state as `steps' calls of Simulate() if allowed by JumpLength()
+	void World::Jump(size_t steps)
 	{
-		for (const auto& p : platform_) {
-			if (!p->IsOutputCorrect()) {
-				return false;
+		Ui64 prevHash = hash_;
+		if (journalLimit_) {
+			ClearJournal(); // journal is undone step by step, jumped steps cannot be
+		}
+		stepTiles_.clear();
+		stepRobots_.clear();
+		for (Si32 i : active_) {
+			const Robot& r = robot_[i];
+			Vec3Si32 w = platform_[r.platform()]->ToWorld(r.x(), r.y(), 0);
+			occupied_[w.z].set(w.x, w.y, false);
+			hash_ ^= RobotHash(i, r);
+			Robot before = r;
+			robot_[i].Cruise(Si32(steps));
+			hash_ ^= RobotHash(i, r);
+			if (!listeners_.empty()) {
+				stepRobots_.push_back(RobotChange{i, before, r});
+			}
+		}
+		for (Si32 i : active_) {
+			const Robot& r = robot_[i];
+			Vec3Si32 w = platform_[r.platform()]->ToWorld(r.x(), r.y(), 0);
+			occupied_[w.z].set(w.x, w.y, true);
+			cell_[i] = next_[i] = wparams_.index(w.x, w.y, w.z);
+		}
+		steps_ += steps;
+		DetectLoop(prevHash);
+		NotifyChanges();
+	}
+
+	// Number of steps robot on given tile can make in direction `dir' without reading letters
+	Ui16 World::RunLength(Si32 platform, Si32 rx, Si32 ry, Si32 dir) const
+	{
+		static const Si32 kDx[] = { 0, 1, 0, -1, 0 };
+		static const Si32 kDy[] = { 0, 0, 1, 0, -1 };
+		Platform* p = platform_[platform].get();
+		const Tile* tile = p->get_tile(rx, ry);
+		if (!tile->IsMovable() || !tile->touched() || tile->letter() != kLtSpace) {
+			return 0; // robot reads something
+		}
+		Si32 nx = rx + kDx[dir];
+		Si32 ny = ry + kDy[dir];
+		Vec3Si32 next = p->ToWorld(nx, ny, 0);
+		if (!IsMovable(next) || FindPlatform(next) != p) {
+			return 0; // robot stops or changes platform
+		}
+		Ui16 run = runs_[platform][(ny * p->w() + nx) * 4 + dir - 1];
+		return run == 0xffff ? run : run + 1;
+	}
+
+	void World::IndexRuns(Si32 platform)
+	{
+		Platform* p = platform_[platform].get();
+		std::vector<Ui16>& runs = runs_[platform];
+		runs.assign(p->w() * p->h() * 4, 0);
+		for (Si32 dir = Robot::kDirRight; dir <= Robot::kDirDown; dir++) {
+			// go against direction to have run of next tile computed first
+			bool backX = (dir == Robot::kDirRight);
+			bool backY = (dir == Robot::kDirUp);
+			for (Si32 j = 0; j < p->h(); j++) {
+				for (Si32 i = 0; i < p->w(); i++) {
+					Si32 rx = backX ? p->w() - 1 - i : i;
+					Si32 ry = backY ? p->h() - 1 - j : j;
+					runs[(ry * p->w() + rx) * 4 + dir - 1] = RunLength(platform, rx, ry, dir);
+				}
 			}
 		}
-		return true;
 	}
 
-	Tile* World::At(Vec3Si32 w)
+	// Should be called after tile `w' of platform is changed in a way that matters for RunLength()
+	void World::UpdateRuns(Si32 platform, Vec3Si32 w)
 	{
-		for (const auto& p : platform_) {
-			if (Tile* tile = p->At(w)) {
-				return tile;
+		static const Si32 kDx[] = { 0, 1, 0, -1, 0 };
+		static const Si32 kDy[] = { 0, 0, 1, 0, -1 };
+		Platform* p = platform_[platform].get();
+		std::vector<Ui16>& runs = runs_[platform];
+		for (Si32 dir = Robot::kDirRight; dir <= Robot::kDirDown; dir++) {
+			// runs of tiles behind changed one depend on it until the first unchanged run
+			Si32 rx = p->PlatformX(w.x);
+			Si32 ry = p->PlatformY(w.y);
+			while (rx >= 0 && rx < p->w() && ry >= 0 && ry < p->h()) {
+				Ui16 run = RunLength(platform, rx, ry, dir);
+				Ui16& stored = runs[(ry * p->w() + rx) * 4 + dir - 1];
+				if (stored == run && (rx != p->PlatformX(w.x) || ry != p->PlatformY(w.y))) {
+					break;
+				}
+				stored = run;
+				rx -= kDx[dir];
+				ry -= kDy[dir];
 			}
 		}
-		return nullptr;
 	}
 
-	void World::ForEachTile(std::function<void(Vec3Si32, Tile*)> func)
+	void World::SetJournalLimit(size_t bytes)
 	{
-		for (const auto& p : platform_) {
-			p->ForEachTile(func);
-		}
+		journalLimit_ = bytes;
+		ClearJournal();
 	}
 
-	void World::SaveTo(std::ostream & s) const
+	// Restores state before last recorded step in O(changes made by step)
+	bool World::Undo()
 	{
-		wparams_.SaveTo(s);
-		Save<size_t>(s, platform_.size());
-		for (const auto& p : platform_) {
-			p->SaveTo(s);
-		}
-		Save<size_t>(s, robot_.size());
-		for (const auto& r : robot_) {
-			r->SaveTo(s);
+		if (journalStep_ == 0) {
+			return false;
 		}
-		Save<size_t>(s, kLtMax);
-		for (size_t i = 0; i < kLtMax; i++) {
-			Save(s, isLetterAllowed_[i]);
+		const StepRecord& record = journal_[--journalStep_];
+		journalTile_ -= record.tiles;
+		journalRobot_ -= record.robots;
+		for (size_t i = journalTile_ + record.tiles; i-- > journalTile_; ) {
+			const TileChange& change = journalTiles_[i];
+			Platform* p = platform_[change.platform].get();
+			*p->changable_tile(p->PlatformX(change.w.x), p->PlatformY(change.w.y)) = change.before;
+			p->LetterChanged(change.after, change.before);
+		}
+		for (size_t i = journalRobot_; i < journalRobot_ + record.robots; i++) {
+			const RobotChange& change = journalRobots_[i];
+			robot_[change.index] = change.before;
+		}
+		hash_ = record.hashBefore;
+		steps_--;
+		if (!loop_) {
+			ResetLoop(); // detected loop is still ahead in the same simulation
+		}
+		WakeAll();
+
+		if (!listeners_.empty()) {
+			// report changes reverted in reverse order
+			stepTiles_.clear();
+			stepRobots_.clear();
+			for (size_t i = journalTile_ + record.tiles; i-- > journalTile_; ) {
+				const TileChange& change = journalTiles_[i];
+				stepTiles_.push_back(TileChange{change.platform, change.w, change.after, change.before});
+			}
+			for (size_t i = journalRobot_; i < journalRobot_ + record.robots; i++) {
+				const RobotChange& change = journalRobots_[i];
+				stepRobots_.push_back(RobotChange{change.index, change.after, change.before});
+			}
+			NotifyChanges();
 		}
-		Save(s, steps_);
+		return true;
 	}
 
-	void World::LoadFrom(std::istream& s)
+	// Repeats last undone step in O(changes made by step)
+	bool World::Redo()
 	{
-		wparams_.LoadFrom(s);
-		size_t platforms;
-		Load(s, platforms);
-		platform_.resize(platforms);
-		for (auto& p : platform_) {
-			p.reset(new Platform());
-			p->LoadFrom(s);
+		if (journalStep_ == journal_.size()) {
+			return false;
 		}
-		size_t robots;
-		Load(s, robots);
-		robot_.resize(robots);
-		for (auto& r : robot_) {
-			r.reset(new Robot());
-			r->LoadFrom(s);
+		const StepRecord& record = journal_[journalStep_++];
+		for (size_t i = journalTile_; i < journalTile_ + record.tiles; i++) {
+			const TileChange& change = journalTiles_[i];
+			Platform* p = platform_[change.platform].get();
+			*p->changable_tile(p->PlatformX(change.w.x), p->PlatformY(change.w.y)) = change.after;
+			p->LetterChanged(change.before, change.after);
 		}
-		size_t maxLetters;
-		Load(s, maxLetters);
-		for (size_t i = 0; i < maxLetters; i++) {
-			Load(s, isLetterAllowed_[i]);
+		for (size_t i = journalRobot_; i < journalRobot_ + record.robots; i++) {
+			const RobotChange& change = journalRobots_[i];
+			robot_[change.index] = change.after;
 		}
-		Load(s, steps_);
-	}
-
-	ViewPort::ViewPort(World* world)
-		: wparams_(world->params())
-		, cmnds_(wparams_.size() * zlSize)
-		, visible_z_(wparams_.zsize())
-	{
-		transparent_.Create(screen::w, screen::h);
-		xmin_ = std::numeric_limits<float>::max();
-		ymin_ = std::numeric_limits<float>::max();
-		xmax_ = std::numeric_limits<float>::min();
-		ymax_ = std::numeric_limits<float>::min();
-		world->ForEachTile([=](Vec3Si32 w, Tile*) {
-			Pos p(w);
-			if (xmin_ > -p.x) {
-				xmin_ = -(float)p.x;
-			}
-			if (ymin_ > -p.y) {
-				ymin_ = -(float)p.y;
-			}
-			if (xmax_ < -p.x) {
-				xmax_ = -(float)p.x;
-			}
-			if (ymax_ < -p.y) {
-				ymax_ = -(float)p.y;
-			}
-		});
-		
-		//xmin_ = xmax_ = ymin_ = ymax_ = 0;
-
-		// adjustments for the fact that Pos gives coords of the top corner of tile
-		xmin_ -= Pos::dx;
-		xmax_ += Pos::dx;
-		ymin_ -= 2*Pos::dy;
-		ymax_ += Pos::dz;
-
-		// adjustment for screen center
-		xmin_ += screen::cx;
-		xmax_ += screen::cx;
-		ymin_ += screen::cy;
-		ymax_ += screen::cy;
-        
-		// adjustment for tile position
-		xmin_ -= g_xtileorigin;
-		xmax_ -= g_xtileorigin;
-		ymin_ -= g_ytileorigin;
-		ymax_ -= g_ytileorigin;
-
-        // adjustment for screen size
-        float xscreen = (float)screen::w;
-        float yscreen = (float)screen::h;
-        if (xmax_ - xmin_ < xscreen) {
-            xmin_ = xmax_ = (xmin_ + xmax_ ) / 2;
-        } else {
-            xmin_ += xscreen / 2;
-            xmax_ -= xscreen / 2;
-        }
-        if (ymax_ - ymin_ < yscreen) {
-            ymin_ = ymax_ = (ymin_ + ymax_ ) / 2;
-        } else {
-            ymin_ += yscreen / 2;
-            ymax_ -= yscreen / 2;
-        }
-
-		Center();
-	}
-
-	ViewPort::RenderCmnd* ViewPort::GetRenderCmnd(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz)
-	{
-		for (Si32 zl = 0; zl < zlSize; zl++) {
-			RenderList& rlist = renderList(wx, wy, wz, zl);
-			for (RenderCmnd& cmnd : rlist.next) {
-				if (cmnd.sprite_ == sprite) {
-					return &cmnd;
-				}
-			}
+		if (!listeners_.empty()) {
+			stepTiles_.assign(journalTiles_.begin() + journalTile_, journalTiles_.begin() + journalTile_ + record.tiles);
+			stepRobots_.assign(journalRobots_.begin() + journalRobot_, journalRobots_.begin() + journalRobot_ + record.robots);
 		}
-		return nullptr;
+		journalTile_ += record.tiles;
+		journalRobot_ += record.robots;
+		hash_ = record.hashAfter;
+		steps_++;
+		if (!loop_) {
+			ResetLoop(); // detected loop is still ahead in the same simulation
+		}
+		WakeAll();
+		NotifyChanges();
+		return true;
 	}
 
-	ViewPort::RenderCmnd* ViewPort::GetRenderCmnd(Sprite* sprite, Vec3Si32 w)
+	void World::ClearJournal()
 	{
-		return GetRenderCmnd(sprite, w.x, w.y, w.z);
+		journal_.clear();
+		journalTiles_.clear();
+		journalRobots_.clear();
+		journalStep_ = 0;
+		journalTile_ = 0;
+		journalRobot_ = 0;
 	}
 
-	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl, Vec2Si32 off)
+	void World::AddListener(WorldListener* listener)
 	{
-		RenderList& rlist = renderList(wx, wy, wz, zl);
-		rlist.next.emplace_back(RenderCmnd(RenderCmnd::kSprite, sprite, off));
-		return rlist.next.back();
+		listeners_.push_back(listener);
 	}
 
-	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl)
+	void World::RemoveListener(WorldListener* listener)
 	{
-		return Draw(sprite, wx, wy, wz, zl, Vec2Si32(0, 0));
+		listeners_.erase(std::remove(listeners_.begin(), listeners_.end(), listener), listeners_.end());
 	}
 
-	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Vec3Si32 w, Si32 zl, Vec2Si32 off)
+	void World::NotifyChanges()
 	{
-		return Draw(sprite, w.x, w.y, w.z, zl, off);
+		for (WorldListener* listener : listeners_) {
+			listener->OnChanges(*this, stepTiles_, stepRobots_);
+		}
 	}
 
-	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Vec3Si32 w, Si32 zl)
+	// Robot stays in its cell until letter in the cell is changed
+	// Returns false if robot should be kept awake
+	bool World::Sleep(Si32 i)
 	{
-		return Draw(sprite, w, zl, Vec2Si32(0, 0));
+		Si32 cell = cell_[i];
+		if (sleeper_.empty()) {
+			sleeper_.assign(wparams_.size(), -1);
+		}
+		if (sleeper_[cell] != -1) {
+			return false; // robots placed into one cell
+		}
+		sleeper_[cell] = i;
+		sleep_[i] = cell;
+		return true;
 	}
 
-	ViewPort::RenderCmnd& ViewPort::DrawShadow(Si32 wx, Si32 wy, Si32 wz, Si32 zl)
+	// Wakes robot sleeping in cell whose letter is changed
+	void World::Wake(Si32 cell)
 	{
-		RenderList& rlist = renderList(wx, wy, wz, zl);
-		rlist.next.emplace_back(RenderCmnd(Shadow(world_, Vec3Si32(wx, wy, wz))));
-		return rlist.next.back();
-	}
+		Si32 i = sleeper_[cell];
+		if (simulating_ == -1 || simulating_ < i) {
+			// command was not read in this step yet
+			sleeper_[cell] = -1;
+			sleep_[i] = -1;
+			active_.insert(std::upper_bound(active_.begin(), active_.end(), i), i);
+		}
+		else {
+			woken_.push_back(i);
+		}
+	}
 
-	void ViewPort::BeginRender(double time)
+	void World::WakeAll()
 	{
-		curFrameTime_ = time;
-		if (lastFrameTime_ == 0.0) {
-			lastFrameTime_ = curFrameTime_ - 1.0;
+		runs_.clear(); // tiles could be changed bypassing TileChanged()
+		IndexRobots();
+		for (Si32 cell : sleep_) {
+			if (cell != -1) {
+				sleeper_[cell] = -1;
+			}
+		}
+		if (sleeper_.size() != (size_t)wparams_.size()) {
+			sleeper_.clear();
+		}
+		sleep_.assign(robot_.size(), -1);
+		woken_.clear();
+		active_.resize(robot_.size());
+		for (Si32 i = 0; i < (Si32)robot_.size(); i++) {
+			active_[i] = i;
 		}
-		transparent_.Clear();
 	}
 
-	void ViewPort::ApplyCommands()
+	// Should be called after any change of state that is not done by simulation
+	void World::OnEdit()
 	{
-		RenderList* rlist = &cmnds_[0];
-		drawn_z_ = std::min(visible_z_ + 1, wparams_.zsize());
-		for (Pos p2 = GetPos(0, 0); p2.wz < drawn_z_; p2.Ceil()) {
-			for (Si32 zl = 0; zl < zlSize; zl++) {
-				RenderCmnd::Filter filter = p2.wz < visible_z_ ? RenderCmnd::kFilterNone : RenderCmnd::kFilterTransparent;
-				for (Pos p1 = p2; p1.wy < wparams_.ysize(); p1.Up()) {
-					for (Pos p0 = p1; p0.wx < wparams_.xsize(); p0.Right()) {
-						for (RenderCmnd& cmnd : rlist->next) {
-							cmnd.Apply(this, p0.x, p0.y, filter);
-						}
-						rlist->EndRender();
-						rlist++;
-					}
-				}
-			}
+		WakeAll();
+		ResetLoop();
+		ClearJournal(); // recorded changes cannot be undone over edits
+		for (WorldListener* listener : listeners_) {
+			listener->OnEdit(*this);
+		}
+	}
+
+	// Brent's cycle detection on state hashes, compares with checkpoint once per step
+	void World::DetectLoop(Ui64 prevHash)
+	{
+		if (loop_) {
+			return; // deterministic simulation never leaves loop
+		}
+		if (hash_ == prevHash) {
+			loop_ = 1; // quiescence is detected immediately
+		}
+		else if (hash_ == loopHash_) {
+			loop_ = steps_ - loopStep_;
+		}
+		else if (steps_ - loopStep_ >= loopPower_) {
+			loopHash_ = hash_;
+			loopStep_ = steps_;
+			loopPower_ *= 2;
 		}
 	}
 
-	void ViewPort::DrawCeiling(Vec3Si32 w)
-	{
-		// TODO: start/finish animation???
-		Si32 xRadius = Pos::dx;
-		Si32 yRadius = Pos::dy;
-		Si32 aspect = Pos::dx / Pos::dy;
-		Si32 aspectSq = aspect*aspect;
-
-		Si32 rsqMax = xRadius*xRadius + yRadius*yRadius*aspectSq;
-		Sprite bb = ae::GetEngine()->GetBackbuffer();
-		
-		Pos pos = GetPos(w.x, w.y, w.z);
-		Si32 cx = pos.x + g_tileCenter.x;
-		Si32 cy = pos.y + g_tileCenter.y + Pos::dz;
-
-		Si32 x1 = cx - 2 * xRadius;
-		Si32 x2 = cx + 2 * xRadius + 1;
-		Si32 y1 = cy - 2 * yRadius;
-		Si32 y2 = cy + 2 * yRadius + 1;
-
-		x1 = (x1 < 0 ? 0 : x1);
-		x2 = (x2 > bb.Width() ? bb.Width() : x2);
-		y1 = (y1 < 0 ? 0 : y1);
-		y2 = (y2 > bb.Height() ? bb.Height() : y2);
-
-		Si32 offs = y1 * bb.Width() + x1;
-		Rgba* bg = bb.RgbaData() + offs;
-		Rgba* fg = transparent_.RgbaData() + offs;
-
-		for (Si32 y = y1; y < y2; y++) {
-			Ui64 ysq = (y - cy)*(y - cy)*aspectSq;
-			Rgba* bg0 = bg;
-			Rgba* fg0 = fg;
-			for (Si32 x = x1; x < x2; x++) {
-				Ui64 rsq = (x - cx)*(x - cx) + ysq;
-				Ui32 alpha = Ui32(arctic::Clamp(float(rsq) / rsqMax, 0.0f, 1.0f) * 256.0f + 0.5f);
-				if (fg->a > 0) {
-                    Ui32 k = std::min(256 - alpha, (Ui32)fg->a);
-					*bg = RgbaSum(
-						RgbaMult(*fg, k),
-						RgbaMult(*bg, 256 - k)
-					);
+	void World::ResetLoop()
+	{
+		loopHash_ = hash_;
+		loopStep_ = steps_;
+		loopPower_ = 1;
+		loop_ = 0;
+	}
+
+	Ui64 World::TileHash(Si32 platform, Vec3Si32 w, const Tile& tile) const
+	{
+		Ui64 h = HashMix((Ui64(Ui32(platform)) << 32) | Ui64(Ui32(wparams_.index(w.x, w.y, w.z))));
+		return HashMix(h ^ (Ui64(tile.letter()) << 1) ^ Ui64(tile.touched()));
+	}
+
+	Ui64 World::RobotHash(Si32 i, const Robot& robot) const
+	{
+		return HashMix(HashMix(Ui64(Ui32(i))) ^ robot.StateHash());
+	}
+
+	// Note that tiles outside of world bounds are never changed by simulation and thus not hashed
+	void World::HashPlatform(Platform* platform)
+	{
+		for (Si32 ry = 0; ry < platform->h(); ry++) {
+			for (Si32 rx = 0; rx < platform->w(); rx++) {
+				Vec3Si32 w = platform->ToWorld(rx, ry, 0);
+				if (wparams_.contains(w)) {
+					hash_ ^= TileHash(platform->index(), w, *platform->get_tile(rx, ry));
 				}
-				fg++;
-				bg++;
 			}
-			bg = bg0 + bb.Width();
-			fg = fg0 + bb.Width();
 		}
-		//DrawWithFixedAlphaBlend(transparent_, 0, 0, 128);
 	}
 
-	void ViewPort::EndRender(bool drawCeiling, Vec3Si32 w)
+	void World::Rehash()
 	{
-		ApplyCommands();
-		if (drawCeiling) {
-			DrawCeiling(w);
+		hash_ = 0;
+		for (const auto& p : platform_) {
+			HashPlatform(p.get());
+		}
+		for (Si32 i = 0; i < (Si32)robot_.size(); i++) {
+			hash_ ^= RobotHash(i, robot_[i]);
 		}
-		lastFrameTime_ = curFrameTime_;
 	}
 
-	void ViewPort::Event(Vec2Si32 s, std::function<void(EventHandling& eh, Ui64 tag, void* data)> handler)
+	// Prepares movements of awake robots into next_ as structure-of-arrays pass over cells
+	void World::PrepareMoves()
 	{
-		EventHandling eh(this);
-		Si32 zsize = drawn_z_ - 1; // do not pass events to transparent ceiling z-level
-		Pos p2 = GetPos(wparams_.xsize() - 1, wparams_.ysize() - 1, zsize - 1);
-		RenderList* rlist = &renderList(p2.wx, p2.wy, p2.wz, zlSize - 1);
-		for (; p2.wz >= 0; p2.Floor()) {
-			for (eh.zl_ = zlSize - 1; eh.zl_ >= 0; eh.zl_--) {
-				for (Pos p1 = p2; p1.wy >= 0; p1.Down()) {
-					for (eh.p_ = p1; eh.p_.wx >= 0; eh.p_.Left()) {
-						for (auto i = rlist->prev.rbegin(), e = rlist->prev.rend(); i != e; ++i) {
-							RenderCmnd& cmnd = *i;
-							if (cmnd.passing_ == kPass) {
-								continue;
-							}
-							if (cmnd.IsHit(s, eh)) {
-								if (cmnd.passing_ == kBlock) {
-									return;
-								}
-								else { // kInteract
-									handler(eh, cmnd.tag_, cmnd.data_);
-									if (!eh.propagate_) {
-										return;
-									}
-								}
-							}
+		if (!exits_) {
+			IndexExits();
+		}
+		const Si32 offset[] = { 0, 1, wparams_.xsize(), -1, -wparams_.xsize() };
+		const Ui8* exits = exits_->data();
+		const Ui8* heading = heading_.data();
+		const Si32* cell = cell_.data();
+		Si32* next = next_.data();
+		for (Si32 i : active_) {
+			Si32 dir = heading[i];
+			next[i] = cell[i] + ((exits[cell[i]] >> dir) & 1) * offset[dir];
+		}
+	}
+
+	// Stops conflicting movements prepared by PrepareMoves() by setting next_ to cell_
+	// Gives exactly the same result as ResolveMovesPairwise() in linear time:
+	//  - robot moving into cell claimed by robot with higher priority stops
+	//    (equal priority is won by the robot added to the world first);
+	//  - robot moving into occupied cell stops unless occupant moves away;
+	//  - robots swapping their cells stop, longer cycles of robots keep moving.
+	void World::ResolveMoves()
+	{
+		enum { kUnresolved = 0, kChained, kMoves, kStops };
+
+		occupant_.resize(wparams_.size(), -1);
+		claim_.resize(wparams_.size(), -1);
+		resolution_.resize(robot_.size());
+
+		// Reserve cells (sleeping robots keep theirs in sleeper_) and stop robots that lost their claims
+		for (Si32 i : active_) {
+			resolution_[i] = kUnresolved;
+			occupant_[cell_[i]] = i;
+			if (next_[i] != cell_[i]) {
+				Si32& claim = claim_[next_[i]];
+				if (claim == -1 || priority_[claim] < priority_[i]) {
+					if (claim != -1) {
+						resolution_[claim] = kStops;
+					}
+					claim = i;
+				}
+				else {
+					resolution_[i] = kStops;
+				}
+			}
+			else {
+				resolution_[i] = kStops;
+			}
+		}
+
+		// Follow chains of claim winners moving one after another
+		// Every cell is claimed once, so chain either ends or loops back to its first robot
+		for (Si32 i : active_) {
+			if (resolution_[i] != kUnresolved) {
+				continue;
+			}
+			chain_.clear();
+			Si32 result = kMoves;
+			for (Si32 j = i; ; ) {
+				chain_.push_back(j);
+				resolution_[j] = kChained;
+				Si32 cell = next_[j];
+				Si32 o = occupant_[cell];
+				if (o == -1) {
+					if (!sleeper_.empty() && sleeper_[cell] != -1) {
+						result = kStops; // sleeping robot never moves
+					}
+					break; // free cell
+				}
+				if (resolution_[o] == kChained) {
+					if (chain_.size() == 2) {
+						result = kStops; // front-to-front deadlock
+					}
+					break; // robots move in cycle
+				}
+				if (resolution_[o] != kUnresolved) {
+					result = resolution_[o];
+					break;
+				}
+				j = o;
+			}
+			for (Si32 j : chain_) {
+				resolution_[j] = result;
+			}
+		}
+
+		// Apply and release reservations
+		for (Si32 i : active_) {
+			occupant_[cell_[i]] = -1;
+			if (next_[i] != cell_[i]) {
+				claim_[next_[i]] = -1;
+				if (resolution_[i] == kStops) {
+					next_[i] = cell_[i];
+				}
+			}
+		}
+	}
+
+	// Reference O(n^2) implementation of ResolveMoves() that stops conflicting `next' movements
+	void World::ResolveMovesPairwise(std::vector<Si32>& next) const
+	{
+		// Resolve movements until there are conflicts
+		size_t resolved;
+		do {
+			resolved = 0;
+			for (Si32 i1 = 0; i1 < (Si32)robot_.size(); i1++) {
+				for (Si32 i2 = 0; i2 < (Si32)robot_.size(); i2++) {
+					if (i1 == i2) {
+						continue;
+					}
+
+					// front-to-front deadlock -- block both
+					if (next[i1] == cell_[i2] && cell_[i1] == next[i2]) {
+						next[i1] = cell_[i1];
+						next[i2] = cell_[i2];
+						resolved += 2;
+					}
+					else if (next[i1] == next[i2]) {
+						if (next[i1] == cell_[i1]) { // movement into stopped robot
+							next[i2] = cell_[i2];
 						}
-						rlist--;
+						else if (next[i2] == cell_[i2]) { // movement into stopped robot
+							next[i1] = cell_[i1];
+						}
+						else { // use priority
+							Si32 i = priority_[i1] < priority_[i2] ? i1 : i2;
+							next[i] = cell_[i];
+						}
+						resolved++;
 					}
 				}
 			}
+		} while (resolved);
+	}
+
+	bool World::ReadLetter(Vec3Si32 w, Letter& letter)
+	{
+		if (Tile* tile = CoverTile(w)) {
+			Tile before = *tile;
+			letter = tile->ReadLetter();
+			TileChanged(Cell(w)->cover, w, before, *tile);
+			return true;
 		}
+		return false;
 	}
 
-	void ViewPort::Move(Vec2F delta)
+	// Returns true iff ReadLetter() would succeed
+	bool World::IsReadable(Vec3Si32 w) const
 	{
-		x_ = ae::Clamp(x_ + delta.x, xmin_, xmax_);
-		y_ = ae::Clamp(y_ + delta.y, ymin_, ymax_);
+		const CellIndex* cell = Cell(w);
+		return cell && cell->cover != -1;
 	}
 
-	void ViewPort::MoveNoClamp(Vec2F delta)
+	// Returns true iff WriteLetter() would succeed
+	bool World::IsWritable(Vec3Si32 w) const
 	{
-		x_ += delta.x;
-		y_ += delta.y;
+		const CellIndex* cell = Cell(w);
+		return cell && cell->owner != -1;
 	}
 
-	void ViewPort::Locate(Vec2F loc)
+	// Reads command from tile `w' of given platform that robot stands on
+	Letter World::ReadCommand(Si32 platform, Vec3Si32 w)
 	{
-		x_ = loc.x;
-		y_ = loc.y;
+		Platform* p = platform_[platform].get();
+		Si32 rx = p->PlatformX(w.x);
+		Si32 ry = p->PlatformY(w.y);
+		const Tile* tile = p->get_tile(rx, ry);
+		if (!tile->touched()) { // avoid copying shared tiles unless changed
+			Tile* changable = p->changable_tile(rx, ry);
+			Tile before = *changable;
+			Letter letter = changable->ReadLetter();
+			TileChanged(platform, w, before, *changable);
+			return letter;
+		}
+		return tile->letter();
 	}
 
-	void ViewPort::Center()
+	bool World::WriteLetter(Vec3Si32 w, Letter letter)
 	{
-		Locate(Vec2F((xmin_ + xmax_) / 2, (ymin_ + ymax_) / 2));
+		if (Tile* tile = OwnerTile(w)) {
+			Tile before = *tile;
+			tile->WriteLetter(letter);
+			TileChanged(Cell(w)->owner, w, before, *tile);
+			return true;
+		}
+		return false;
 	}
 
-	void ViewPort::IncVisibleZ()
+	// Should be called on every change of tile `w' of given platform made by simulation
+	void World::TileChanged(Si32 platform, Vec3Si32 w, const Tile& before, const Tile& after)
 	{
-		if (visible_z_ < wparams_.zsize()) {
-			visible_z_++;
+		if (before != after) {
+			platform_[platform]->LetterChanged(before, after);
+			hash_ ^= TileHash(platform, w, before) ^ TileHash(platform, w, after);
+			if ((size_t)platform < runs_.size() && !runs_[platform].empty()) {
+				UpdateRuns(platform, w);
+			}
+			if (!sleeper_.empty()) {
+				Si32 cell = wparams_.index(w.x, w.y, w.z);
+				if (sleeper_[cell] != -1) {
+					Wake(cell);
+				}
+			}
+			if (IsRecording()) {
+				stepTiles_.push_back(TileChange{platform, w, before, after});
+			}
 		}
 	}
 
-	void ViewPort::DecVisibleZ()
+	bool World::IsMovable(Vec3Si32 w) const
 	{
-		if (visible_z_ > 1) {
-			visible_z_--;
+		return wparams_.contains(w) && (*layers_)[w.z].movable.get(w.x, w.y);
+	}
+
+	// Returns true iff any platform has non-empty tile in cell
+	bool World::IsSolid(Vec3Si32 w) const
+	{
+		return wparams_.contains(w) && (*layers_)[w.z].solid.get(w.x, w.y);
+	}
+
+	// Returns 3x3 bitmask of solid cells above `w': bit (dy + 1) * 3 + (dx + 1) is set
+	// iff cell `w' + (dx, dy, 1) is solid
+	Ui16 World::Ceiling(Vec3Si32 w) const
+	{
+		Ui16 bits = 0;
+		for (Si32 dy = -1; dy <= 1; dy++) {
+			for (Si32 dx = -1; dx <= 1; dx++) {
+				if (IsSolid(Vec3Si32(w.x + dx, w.y + dy, w.z + 1))) {
+					bits |= 1 << ((dy + 1) * 3 + dx + 1);
+				}
+			}
 		}
+		return bits;
 	}
 
-    void ViewPort::SetVisibleZ(Si32 z)
-    {
-        visible_z_ = ae::Clamp(z, 1, wparams_.zsize() + 1);
-    }
-    
-	// Converts screen coords `p' into world coords at given z-level `wz'
-	Vec3Si32 ViewPort::ToWorldAtZ(Si32 wz, Vec2Si32 p) const
-	{
-		p.x -= Si32(x_ + 0.5f);
-		p.y -= Si32(y_ + 0.5f);
-		p.x -= g_xtileorigin;
-		p.y -= g_ytileorigin;
-		return Pos::ToWorld(p, wz);
-	}
-
-	// Converts screen coords `p' into world coords and tile coords `tp' at given z-level `wz'
-	Vec3Si32 ViewPort::ToWorldTileAtZ(Si32 wz, Vec2Si32 p, Vec2F& tp) const
-	{
-		p.x -= Si32(x_ + 0.5f);
-		p.y -= Si32(y_ + 0.5f);
-		p.x -= g_xtileorigin;
-		p.y -= g_ytileorigin;
-		Vec3Si32 result = Pos::ToWorld(p, wz);
-		p -= Pos::ToScreen(result);
-		tp = Pos::ToTile(p);
-		return result;
-	}
-
-	// Search all z-levels for highest with real tile
-	// and converts screen coords `p' into world coords `w' of that tile
-	// Returns false iff real tile was not found (`w' is not changed)
-	bool ViewPort::ToWorld(Vec2Si32 p, Vec3Si32& w) const
-	{
-		for (Si32 wz = visible_z_ - 1; wz >= 0; wz--) {
-			Vec3Si32 w0 = ToWorldAtZ(wz, p);
-			if (Tile* tile = world_->At(w0)) {
-				w = w0;
-				return true;
+	// Returns true iff any robot is in box [w1, w2] of z-level w1.z
+	bool World::IsRobotIn(Vec3Si32 w1, Vec3Si32 w2) const
+	{
+		if (w1.z < 0 || w1.z >= wparams_.zsize()) {
+			return false;
+		}
+		return occupied_[w1.z].Any(std::min(w1.x, w2.x), std::min(w1.y, w2.y),
+			std::max(w1.x, w2.x), std::max(w1.y, w2.y));
+	}
+
+	// Platform tiles, cell index and layers are shared with clone until changed
+	World* World::Clone() const
+	{
+		World* clone = new World();
+		clone->wparams_ = wparams_;
+		clone->cells_ = cells_;
+		clone->layers_ = layers_;
+		clone->exits_ = exits_;
+		for (const auto& p : platform_) {
+			clone->platform_.emplace_back(p->Clone());
+		}
+		clone->robot_ = robot_;
+		for (Si32 i = 0; i < kLtMax; i++) {
+			clone->isLetterAllowed_[i] = isLetterAllowed_[i];
+		}
+		clone->hash_ = hash_;
+		clone->ResetLoop();
+		clone->WakeAll();
+		return clone;
+	}
+
+	Platform* World::FindPlatform(Vec3Si32 w) const
+	{
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->owner != -1) {
+				return platform_[cell->owner].get();
 			}
 		}
-		return false;
+		return nullptr;
 	}
 
-	// Search all z-levels for highest with real tile
-	// and converts screen coords `p' into world coords `w' and tile coords `tp' of that tile
-	// Returns false iff real tile was not found (`w' and `tp' are not changed)
-	bool ViewPort::ToWorldTile(Vec2Si32 p, Vec3Si32& w, Vec2F& tp) const
+	bool World::IsOutputCorrect() const
 	{
-		for (Si32 wz = visible_z_ - 1; wz >= 0; wz--) {
-			Vec2F tp0;
-			Vec3Si32 w0 = ToWorldTileAtZ(wz, p, tp0);
-			if (Tile* tile = world_->At(w0)) {
-				tp = tp0;
-				w = w0;
-				return true;
+		for (const auto& p : platform_) {
+			if (!p->IsOutputCorrect()) {
+				return false;
 			}
 		}
-		return false;
+		return true;
 	}
 
-	Pos ViewPort::GetPos(Si32 wx, Si32 wy, Si32 wz)
-	{
-		Pos p(wx, wy, wz);
-		p.x += Si32(x_ + 0.5f);
-		p.y += Si32(y_ + 0.5f);
-		return p;
-	}
-
-	Sprite ViewPort::ShadowMask(Sprite& surfaceMask, const Shadow& shadow)
-	{
-		if (shadow.ceiling(0, 0)) {
-			Sprite shadowMask;
-			shadowMask.Create(surfaceMask.Width(), surfaceMask.Height());
-			Rgba* shad = shadowMask.RgbaData();
-			Rgba* surf = surfaceMask.RgbaData();
-			for (Si32 y = 0; y < shadowMask.Height(); y++) {
-				for (Si32 x = 0; x < shadowMask.Width(); x++, shad++, surf++) {
-					if (surf->a > 0) {
-						Si32 tx = x - g_xtileorigin;
-						Si32 ty = y - g_ytileorigin;
-						Vec2F tr = Pos::ToTile(Vec2Si32(tx, ty));
-						
-						float light = 0.0f;
-						float contrast = 6.0f;
-						if (!shadow.ceiling(1, 0)) {
-							light = std::max(light, 1.0f - (1.0f - tr.x) * contrast);
-						}
-						if (!shadow.ceiling(0, 1)) {
-							light = std::max(light, 1.0f - (1.0f - tr.y) * contrast);
-						}
-						if (!shadow.ceiling(-1, 0)) {
-							light = std::max(light, 1.0f - (tr.x) * contrast);
-						}
-						if (!shadow.ceiling(0, -1)) {
-							light = std::max(light, 1.0f - (tr.y) * contrast);
-						}
+	const Tile* World::At(Vec3Si32 w) const
+	{
+		return OwnerTile(w);
+	}
 
-						if (!shadow.ceiling(1, 1)) {
-							light = std::max(light, 1.0f - (2.0f - tr.x - tr.y) * contrast);
-						}
-						if (!shadow.ceiling(1, -1)) {
-							light = std::max(light, 1.0f - (1.0f - tr.x + tr.y) * contrast);
-						}
-						if (!shadow.ceiling(-1, 1)) {
-							light = std::max(light, 1.0f - (1.0f - tr.y + tr.x) * contrast);
-						}
-						if (!shadow.ceiling(-1, -1)) {
-							light = std::max(light, 1.0f - (tr.x + tr.y) * contrast);
-						}
-						shad->a = (Ui8)std::max(0.0f, std::min(255.0f, float(surf->a) * (1.0f - light) / 8.0f));
+	void World::ForEachTile(std::function<void(Vec3Si32, const Tile*)> func) const
+	{
+		for (const auto& p : platform_) {
+			p->ForEachTile(func);
+		}
+	}
+
+	void World::SaveTo(BinaryWriter& s) const
+	{
+		s.WriteBytes(kWorldMagic, sizeof(kWorldMagic));
+		s.WriteU32(kWorldVersion);
+		size_t sizeAt = s.size();
+		s.WriteU32(0); // patched with payload size below
+		size_t payloadAt = s.size();
+
+		wparams_.SaveTo(s);
+		s.WriteVar(platform_.size());
+		for (const auto& p : platform_) {
+			p->SaveTo(s);
+		}
+		s.WriteVar(robot_.size());
+		for (const Robot& r : robot_) {
+			r.SaveTo(s);
+		}
+		Ui64 allowed = 0; // bitmask of allowed letters
+		for (size_t i = 0; i < kLtMax; i++) {
+			allowed |= Ui64(isLetterAllowed_[i]) << i;
+		}
+		s.WriteVar(allowed);
+		s.WriteVar(steps_);
+
+		s.PatchU32(sizeAt, Ui32(s.size() - payloadAt));
+	}
+
+	bool World::LoadFrom(BinaryReader& s)
+	{
+		if (!ReadContainer(s)) {
+			return false;
+		}
+		Loaded();
+		OnEdit();
+		return true;
+	}
+
+	// Saves steps, tiles and robots, i.e. all the state that simulation changes
+	// Tiles are run-length encoded per platform as in Platform::SaveTo()
+	void World::SaveStep(BinaryWriter& s) const
+	{
+		s.WriteVar(steps_);
+		for (const auto& p : platform_) {
+			p->SaveTiles(s);
+		}
+		for (const Robot& r : robot_) {
+			r.SaveTo(s);
+		}
+	}
+
+	// Loads state saved by SaveStep() at another step of the same simulation (e.g. by Timeline)
+	// Only tiles and robots that differ are patched, so index and tiles shared with clones are kept
+	// Unlike LoadFrom() keeps detected loop and recorded steps, so that loaded step can be undone or redone
+	// Returns false if data is not of this world, state is left partially loaded then
+	bool World::LoadStep(BinaryReader& s)
+	{
+		size_t first = steps_ - journalStep_; // steps [first, first + journal_.size()] are recorded
+		size_t steps = size_t(s.ReadVar());
+		stepTiles_.clear();
+		stepRobots_.clear();
+		for (const auto& p : platform_) {
+			size_t size = size_t(p->w()) * size_t(p->h());
+			for (size_t i = 0; i < size; ) {
+				Ui64 run = s.ReadVar();
+				Tile tile;
+				if (!tile.LoadFrom(s) || run == 0 || run > size - i) {
+					return false;
+				}
+				for (size_t end = i + size_t(run); i < end; i++) {
+					Si32 rx = Si32(i % p->w());
+					Si32 ry = Si32(i / p->w());
+					Tile before = *p->get_tile(rx, ry);
+					if (before == tile) {
+						continue;
+					}
+					if (before.type() != tile.type() || before.output() != tile.output()) {
+						return false; // simulation changes only letters
+					}
+					*p->changable_tile(rx, ry) = tile;
+					p->LetterChanged(before, tile);
+					Vec3Si32 w = p->ToWorld(rx, ry, 0);
+					if (wparams_.contains(w)) {
+						hash_ ^= TileHash(p->index(), w, before) ^ TileHash(p->index(), w, tile);
+					}
+					if (!listeners_.empty()) {
+						stepTiles_.push_back(TileChange{p->index(), w, before, tile});
 					}
 				}
 			}
-			return shadowMask;
 		}
-		else {
-			return image::g_empty;
+		for (Si32 i = 0; i < (Si32)robot_.size(); i++) {
+			Robot robot;
+			if (!robot.LoadFrom(s) || robot.platform() != robot_[i].platform()) {
+				return false; // robots do not leave their platforms
+			}
+			if (robot != robot_[i]) {
+				hash_ ^= RobotHash(i, robot_[i]) ^ RobotHash(i, robot);
+				if (!listeners_.empty()) {
+					stepRobots_.push_back(RobotChange{i, robot_[i], robot});
+				}
+				robot_[i] = robot;
+			}
+		}
+		if (s.failed()) {
+			return false;
+		}
+		steps_ = steps;
+
+		bool recorded = false;
+		if (!journal_.empty() && steps_ >= first && steps_ - first <= journal_.size()) {
+			journalStep_ = steps_ - first;
+			journalTile_ = 0;
+			journalRobot_ = 0;
+			for (size_t i = 0; i < journalStep_; i++) {
+				journalTile_ += journal_[i].tiles;
+				journalRobot_ += journal_[i].robots;
+			}
+			// same state is expected if it is really the same simulation
+			recorded = hash_ == (journalStep_ < journal_.size()
+				? journal_[journalStep_].hashBefore : journal_[journalStep_ - 1].hashAfter);
+		}
+		if (!recorded) {
+			ClearJournal();
+		}
+		if (!loop_) {
+			ResetLoop(); // detected loop is still ahead in the same simulation
+		}
+		WakeAll();
+		NotifyChanges();
+		return true;
+	}
+
+	// Reads versioned container written by SaveTo(), state is left partially loaded on failure
+	bool World::ReadContainer(BinaryReader& s)
+	{
+		const char* magic = s.ReadBytes(sizeof(kWorldMagic));
+		if (!magic || !std::equal(kWorldMagic, kWorldMagic + sizeof(kWorldMagic), magic)) {
+			return false;
+		}
+		Ui32 version = s.ReadU32();
+		Ui32 size = s.ReadU32();
+		if (s.failed() || size > s.left() || version != kWorldVersion) {
+			return false; // truncated or written by newer version
+		}
+		const char* payload = s.ReadBytes(size);
+		BinaryReader ps(payload, payload + size);
+		return LoadPayload(ps);
+	}
+
+	bool World::LoadPayload(BinaryReader& s)
+	{
+		if (!wparams_.LoadFrom(s)) {
+			return false;
+		}
+		Ui64 platforms = s.ReadVar();
+		if (platforms > s.left()) {
+			return false;
+		}
+		platform_.resize(size_t(platforms));
+		for (size_t i = 0; i < platform_.size(); i++) {
+			auto& p = platform_[i];
+			p.reset(new Platform());
+			if (!p->LoadFrom(s) || p->index() != Si32(i)) {
+				platform_.clear();
+				return false;
+			}
+		}
+		Ui64 robots = s.ReadVar();
+		if (robots > s.left()) {
+			return false;
+		}
+		robot_.clear();
+		robot_.resize(size_t(robots));
+		for (Robot& r : robot_) {
+			if (!r.LoadFrom(s) || r.platform() < 0 || r.platform() >= Si32(platform_.size())
+				|| r.x() < 0 || r.x() >= platform_[r.platform()]->w()
+				|| r.y() < 0 || r.y() >= platform_[r.platform()]->h()
+				|| !wparams_.contains(platform_[r.platform()]->ToWorld(r.x(), r.y(), 0))) {
+				robot_.clear();
+				return false;
+			}
+		}
+		Ui64 allowed = s.ReadVar();
+		for (size_t i = 0; i < kLtMax; i++) {
+			isLetterAllowed_[i] = (allowed >> i) & 1;
+		}
+		steps_ = size_t(s.ReadVar());
+		return !s.failed();
+	}
+
+	void World::SaveTo(std::ostream& s) const
+	{
+		BinaryWriter w;
+		SaveTo(w);
+		s.write(w.data().data(), w.size());
+	}
+
+	// Reads exactly one saved world, so worlds may follow each other in stream
+	bool World::LoadFrom(std::istream& s)
+	{
+		char header[12];
+		s.read(header, sizeof(header));
+		if (s.gcount() >= std::streamsize(sizeof(kWorldMagic))
+			&& !std::equal(kWorldMagic, kWorldMagic + sizeof(kWorldMagic), header)) {
+			// no magic, so it is raw legacy save starting with world params
+			s.clear();
+			s.seekg(-s.gcount(), std::ios::cur);
+			LoadLegacy(s);
+			return !s.fail();
+		}
+		if (s.gcount() != sizeof(header)) {
+			return false;
 		}
+		BinaryReader hs(header, header + sizeof(header));
+		hs.ReadBytes(sizeof(kWorldMagic));
+		hs.ReadU32(); // version is checked below
+		Ui32 size = hs.ReadU32();
+		if (size > BytesLeft(s, kMaxSaveBytes)) {
+			return false; // truncated or damaged, so size is not to be allocated
+		}
+		std::string data(header, sizeof(header));
+		data.resize(sizeof(header) + size);
+		s.read(&data[sizeof(header)], data.size() - sizeof(header));
+		BinaryReader ds(data);
+		return s.gcount() == std::streamsize(data.size() - sizeof(header)) && LoadFrom(ds);
 	}
 
-	ViewPort::RenderCmnd::RenderCmnd(ViewPort::RenderCmnd::Type type,
-		Sprite* sprite, Vec2Si32 off)
-		: type_(type)
-		, sprite_(sprite)
-		, off_(off)
-	{}
+	void World::LoadLegacy(std::istream& s)
+	{
+		// counts come from file, so they are checked before allocation (failbit is set if wrong)
+		wparams_.LoadLegacy(s);
+		size_t platforms = 0;
+		Load(s, platforms);
+		if (!s || platforms > BytesLeft(s, kMaxSaveBytes)) {
+			s.setstate(std::ios::failbit);
+			return;
+		}
+		platform_.resize(platforms);
+		for (size_t i = 0; i < platform_.size(); i++) {
+			auto& p = platform_[i];
+			p.reset(new Platform());
+			p->LoadLegacy(s);
+			if (!s || p->index() != Si32(i)) {
+				platform_.clear();
+				s.setstate(std::ios::failbit);
+				return;
+			}
+		}
+		size_t robots;
+		Load(s, robots);
+		if (!s || robots > BytesLeft(s, kMaxSaveBytes)) {
+			s.setstate(std::ios::failbit);
+			return;
+		}
+		robot_.clear();
+		robot_.resize(robots);
+		for (Robot& r : robot_) {
+			r.LoadLegacy(s);
+			if (!s || r.platform() < 0 || r.platform() >= Si32(platform_.size())
+				|| r.x() < 0 || r.x() >= platform_[r.platform()]->w()
+				|| r.y() < 0 || r.y() >= platform_[r.platform()]->h()
+				|| !wparams_.contains(platform_[r.platform()]->ToWorld(r.x(), r.y(), 0))) {
+				robot_.clear();
+				s.setstate(std::ios::failbit);
+				return;
+			}
+		}
+		size_t maxLetters;
+		Load(s, maxLetters);
+		if (!s || maxLetters > kLtMax) {
+			s.setstate(std::ios::failbit);
+			return;
+		}
+		for (size_t i = 0; i < maxLetters; i++) {
+			Load(s, isLetterAllowed_[i]);
+		}
+		Load(s, steps_);
+		Loaded();
+		OnEdit();
+	}
 
-	ViewPort::RenderCmnd::RenderCmnd(const Shadow& shadow)
-		: type_(kShadow)
-		, shadow_(shadow)
-		, passing_(kPass) // shadow shouldn't block events (which is default)
-	{}
+	// Rebuilds index and hash that are not saved, should be followed by OnEdit() or alike
+	void World::Loaded()
+	{
+		ResetIndex();
+		for (const auto& p : platform_) {
+			IndexPlatform(p.get());
+		}
+		Rehash();
+	}
 
-	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Blend(Rgba rgba)
+	void World::ResetIndex()
 	{
-		blend_ = rgba;
-		return *this;
+		cells_ = std::make_shared<std::vector<CellIndex>>(wparams_.size());
+		Bitboard empty(wparams_.xsize(), wparams_.ysize());
+		layers_ = std::make_shared<std::vector<Layer>>(wparams_.zsize(), Layer{empty, empty, empty});
+		exits_.reset();
 	}
 
-	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Alpha()
+	void World::IndexRobots()
 	{
-		type_ = kSpriteRgba;
-		return *this;
+		if (occupied_.size() != (size_t)wparams_.zsize() || (!occupied_.empty()
+			&& (occupied_[0].w() != wparams_.xsize() || occupied_[0].h() != wparams_.ysize())))
+		{
+			occupied_.assign(wparams_.zsize(), Bitboard(wparams_.xsize(), wparams_.ysize()));
+		}
+		else {
+			for (Bitboard& board : occupied_) {
+				board.Clear();
+			}
+		}
+		cell_.resize(robot_.size());
+		next_.resize(robot_.size());
+		heading_.resize(robot_.size());
+		priority_.resize(robot_.size());
+		for (Si32 i = 0; i < (Si32)robot_.size(); i++) {
+			const Robot& r = robot_[i];
+			Vec3Si32 w = platform_[r.platform()]->ToWorld(r.x(), r.y(), 0);
+			if (wparams_.contains(w)) {
+				occupied_[w.z].set(w.x, w.y, true);
+			}
+			cell_[i] = next_[i] = wparams_.index(w.x, w.y, w.z);
+			priority_[i] = r.priority();
+		}
 	}
 
-	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Opacity(Ui8 value)
+	// Note that tiles outside of world bounds are not indexed and thus ignored
+	void World::IndexPlatform(Platform* platform)
 	{
-		opacity_ = value;
-		return *this;
+		if (cells_.use_count() > 1) {
+			cells_ = std::make_shared<std::vector<CellIndex>>(*cells_);
+		}
+		if (layers_.use_count() > 1) {
+			layers_ = std::make_shared<std::vector<Layer>>(*layers_);
+		}
+		exits_.reset();
+		for (Si32 ry = 0; ry < platform->h(); ry++) {
+			for (Si32 rx = 0; rx < platform->w(); rx++) {
+				Vec3Si32 w = platform->ToWorld(rx, ry, 0);
+				if (wparams_.contains(w)) {
+					CellIndex& cell = (*cells_)[wparams_.index(w.x, w.y, w.z)];
+					Layer& layer = (*layers_)[w.z];
+					const Tile* tile = platform->get_tile(rx, ry);
+					if (cell.cover == -1) {
+						cell.cover = platform->index();
+						layer.movable.set(w.x, w.y, tile->IsMovable());
+						layer.modifiable.set(w.x, w.y, tile->IsModifiable());
+					}
+					if (cell.owner == -1 && tile->type() != kTlNone) {
+						cell.owner = platform->index();
+						layer.solid.set(w.x, w.y, true);
+					}
+				}
+			}
+		}
 	}
 
-	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Interactive(Ui64 tag, void* data)
+	// Depends only on tile types, so is valid until platforms are indexed again
+	void World::IndexExits()
 	{
-		passing_ = kInteract;
-		tag_ = tag;
-		data_ = data;
-		return *this;
+		static const Si32 kDx[] = { 0, 1, 0, -1, 0 };
+		static const Si32 kDy[] = { 0, 0, 1, 0, -1 };
+		exits_ = std::make_shared<std::vector<Ui8>>(wparams_.size(), 0);
+		for (Si32 z = 0; z < wparams_.zsize(); z++) {
+			for (Si32 y = 0; y < wparams_.ysize(); y++) {
+				for (Si32 x = 0; x < wparams_.xsize(); x++) {
+					Ui8& exits = (*exits_)[wparams_.index(x, y, z)];
+					for (Si32 dir = Robot::kDirRight; dir <= Robot::kDirDown; dir++) {
+						if (IsMovable(Vec3Si32(x + kDx[dir], y + kDy[dir], z))) {
+							exits |= Ui8(1 << dir);
+						}
+					}
+				}
+			}
+		}
 	}
 
-	ViewPort::RenderCmnd& ViewPort::RenderCmnd::PassEventThrough()
+	const World::CellIndex* World::Cell(Vec3Si32 w) const
 	{
-		passing_ = kPass;
-		return *this;
+		if (wparams_.contains(w)) {
+			return &(*cells_)[wparams_.index(w.x, w.y, w.z)];
+		}
+		return nullptr;
 	}
 
-	void ViewPort::RenderCmnd::Apply(ViewPort* vp, Si32 x, Si32 y, ViewPort::RenderCmnd::Filter filter)
+	// Returns tile of the first platform containing `w' within its bounds (tile can be empty)
+	Tile* World::CoverTile(Vec3Si32 w)
 	{
-		Sprite to_sprite = filter == kFilterTransparent? vp->transparent(): ae::GetEngine()->GetBackbuffer();
-		x += off_.x;
-		y += off_.y;
-		switch (type_) {
-		case kSprite:
-			if (blend_.a == 0) {
-                sprite_->Draw(x, y, sprite_->Width(), sprite_->Height(),
-                              0, 0, sprite_->Width(), sprite_->Height(), to_sprite);
-            }
-			else {
-				DrawAndBlend(*sprite_, x, y, to_sprite, blend_);
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->cover != -1) {
+				Platform* p = platform_[cell->cover].get();
+				return p->changable_tile(p->PlatformX(w.x), p->PlatformY(w.y));
 			}
-			break;
-		case kSpriteRgba:
-			if (blend_.a == 0) {
-				AlphaDraw(*sprite_, x, y, to_sprite, opacity_);
+		}
+		return nullptr;
+	}
+
+	const Tile* World::CoverTile(Vec3Si32 w) const
+	{
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->cover != -1) {
+				Platform* p = platform_[cell->cover].get();
+				return p->get_tile(p->PlatformX(w.x), p->PlatformY(w.y));
 			}
-			else {
-				AlphaDrawAndBlend(*sprite_, x, y, to_sprite, blend_, opacity_);
+		}
+		return nullptr;
+	}
+
+	// Returns first non-empty tile at `w'
+	Tile* World::OwnerTile(Vec3Si32 w)
+	{
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->owner != -1) {
+				Platform* p = platform_[cell->owner].get();
+				return p->changable_tile(p->PlatformX(w.x), p->PlatformY(w.y));
 			}
-			break;
-		case kShadow:
-			AlphaDrawAndBlend(vp->ShadowMask(image::g_tileMask, shadow_), x, y, to_sprite, Rgba(0, 0, 0, 255), opacity_);
-			break;
 		}
+		return nullptr;
 	}
 
-	bool ViewPort::RenderCmnd::IsHit(Vec2Si32 s, const EventHandling& eh, Ui8 alphaThreshold)
+	const Tile* World::OwnerTile(Vec3Si32 w) const
 	{
-		// Calculate sprite coordinates
-		Vec2Si32 r = s - eh.p().Screen() + sprite_->Pivot();
-		Rgba* to = sprite_->RgbaData()
-			+ r.y * sprite_->StridePixels()
-			+ r.x;
-		return to->a > alphaThreshold;
+		if (const CellIndex* cell = Cell(w)) {
+			if (cell->owner != -1) {
+				Platform* p = platform_[cell->owner].get();
+				return p->get_tile(p->PlatformX(w.x), p->PlatformY(w.y));
+			}
+		}
+		return nullptr;
 	}
 }
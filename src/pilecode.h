@@ -22,16 +22,15 @@
 
 #pragma once
 
-#include "defs.h"
+#include "types.h"
 #include "result.h"
-
-#include "engine/easy.h"
-#include "engine/vec2si32.h"
-#include "engine/vec3si32.h"
+#include "bitboard.h"
+#include "serialize.h"
 
 #include <iostream>
 #include <vector>
-#include <cmath>
+#include <deque>
+#include <memory>
 #include <algorithm>
 #include <functional>
 
@@ -43,7 +42,8 @@ namespace pilecode {
 	class WorldParams;
 	class World;
 
-	struct Pos;
+	// rendering (see viewport.h)
+	class WorldData;
 	class ViewPort;
 
 	enum TileType {
@@ -77,20 +77,10 @@ namespace pilecode {
 		kLtMax		
 	};
 
-	class Shadow {
-	public:
-		Shadow();
-		Shadow(World* world, Vec3Si32 w);
-		bool& ceiling(Si32 dx, Si32 dy);
-		bool ceiling(Si32 dx, Si32 dy) const;
-	private:
-		bool ceiling_[9]; // 3x3 ceiling bitmask (0=sky; 1=ceiling)
-	};
-
 	class Tile {
 	public:
 		// rendering
-		void Draw(ViewPort* vp, Si32 wx, Si32 wy, Si32 wz, Si32 color);
+		void Draw(ViewPort* vp, Si32 wx, Si32 wy, Si32 wz, Si32 color, Ui16 ceiling) const;
 
 		// simulation
 		Letter ReadLetter();
@@ -99,17 +89,21 @@ namespace pilecode {
 		// utility
 		bool IsMovable() const;
 		bool IsModifiable() const;
-		void SaveTo(std::ostream& s) const;
-		void LoadFrom(std::istream& s);
+		bool IsOutputMismatch() const { return output() != kLtSpace && letter() != output(); }
+		bool operator==(const Tile& other) const { return bits_ == other.bits_; }
+		bool operator!=(const Tile& other) const { return bits_ != other.bits_; }
+		void SaveTo(BinaryWriter& s) const;
+		bool LoadFrom(BinaryReader& s);
+		void LoadLegacy(std::istream& s);
 
 		// accessors
-		TileType type() const { return type_;  }
-		void set_type(TileType type) { type_ = type;  }
-		Letter letter() const { return letter_;  }
-		void set_letter(Letter letter) { letter_ = letter; }
-		bool touched() const { return touched_; }
-		Letter output() const { return output_; }
-		void set_output(Letter letter) { output_ = letter; }
+		TileType type() const { return TileType(field(kTypeShift, kTypeMask)); }
+		void set_type(TileType type) { set_field(kTypeShift, kTypeMask, type); }
+		Letter letter() const { return Letter(field(kLetterShift, kLetterMask)); }
+		void set_letter(Letter letter) { set_field(kLetterShift, kLetterMask, letter); }
+		bool touched() const { return field(kTouchedShift, 1) != 0; }
+		Letter output() const { return Letter(field(kOutputShift, kLetterMask)); }
+		void set_output(Letter letter) { set_field(kOutputShift, kLetterMask, letter); }
 		
 		static const Tile* none()
 		{
@@ -117,21 +111,22 @@ namespace pilecode {
 			return &noneTile;
 		}
 	private:
-		// state
-		TileType type_ = kTlNone;
-		Letter letter_ = kLtSpace;
-		bool touched_ = false;
-
-		// output
-		Letter output_ = kLtSpace;
-	};
+		enum : Ui16 {
+			kTypeShift = 0,
+			kTypeMask = 0x3,
+			kTouchedShift = 2,
+			kLetterShift = 3,
+			kLetterMask = 0x1f,
+			kOutputShift = 8,
+		};
+		static_assert(kTlMax <= kTypeMask + 1, "tile type does not fit into packed tile");
+		static_assert(kLtMax <= kLetterMask + 1, "letter does not fit into packed tile");
 
-	class WorldData {
-	public:
-		explicit WorldData(size_t colors);
-		Sprite* TileSprite(Si32 color, TileType type);
+		Ui16 field(Ui16 shift, Ui16 mask) const { return (bits_ >> shift) & mask; }
+		void set_field(Ui16 shift, Ui16 mask, Ui16 value) { bits_ = Ui16((bits_ & ~(mask << shift)) | ((value & mask) << shift)); }
 	private:
-		std::vector<std::vector<Sprite>> tileSprite_; // tile_[color][tileType]
+		// packed state: type (2 bits), touched (1 bit), letter (5 bits) and output (5 bits)
+		Ui16 bits_ = 0;
 	};
 
 	class WorldParams {
@@ -143,14 +138,21 @@ namespace pilecode {
 		Si32 xsize() const { return xsize_; }
 		Si32 ysize() const { return ysize_; }
 		Si32 zsize() const { return zsize_; }
-		WorldData& data() { return *data_; }
+		WorldData& data(); // created on first use and shared by copies
 
 		Si32 size() const { return xyzsize_; }
 		Si32 index(Si32 x, Si32 y, Si32 z) const { return z * xysize_ + y * xsize_ + x; }
+		bool contains(Vec3Si32 w) const
+		{
+			return w.x >= 0 && w.x < xsize_
+				&& w.y >= 0 && w.y < ysize_
+				&& w.z >= 0 && w.z < zsize_;
+		}
 
 		// utility
-		void SaveTo(std::ostream& s) const;
-		void LoadFrom(std::istream& s);
+		void SaveTo(BinaryWriter& s) const;
+		bool LoadFrom(BinaryReader& s);
+		void LoadLegacy(std::istream& s);
 
 	private:
 		Si32 xsize_;
@@ -160,14 +162,17 @@ namespace pilecode {
 
 		Si32 xysize_;
 		Si32 xyzsize_;
-		std::shared_ptr<WorldData> data_;
+		std::shared_ptr<std::shared_ptr<WorldData>> data_;
 	};
 
 	class Platform {
 	public:
 		Platform();
 		Platform(Si32 x, Si32 y, Si32 z, std::initializer_list<std::initializer_list<Si32>> data);
-		void Draw(ViewPort* vp);
+		Platform(Si32 x, Si32 y, Si32 z, Si32 w, Si32 h, TileType type); // filled with one type of tiles
+		void Draw(ViewPort* vp, Vec3Si32 w);
+		void IndexCeilings(const World* world);
+		void ResetCeilings() { ceilings_.reset(); }
 		Platform* Clone() const;
 		Result<Letter> SetLetter(World* world, Si32 rx, Si32 ry, Letter letter);
 		
@@ -175,14 +180,16 @@ namespace pilecode {
 		const Tile* get_tile(Si32 rx, Si32 ry) const;
 		bool ReadLetter(Si32 rx, Si32 ry, Letter& letter);
 		bool WriteLetter(Si32 rx, Si32 ry, Letter letter);
-		bool IsOutputCorrect();
+		bool IsOutputCorrect() const { return mismatches_ == 0; }
+		void CountMismatches();
+		void LetterChanged(const Tile& before, const Tile& after);
 
 		// transforms coordinates relative to platform to world's frame
 		Si32 WorldX(Si32 rx) const { return rx + x_; }
 		Si32 WorldY(Si32 ry) const { return ry + y_; }
 		Si32 WorldZ(Si32 rz) const { return rz + z_; }
 		Vec3Si32 ToWorld(Si32 rx, Si32 ry, Si32 rz) const { return Vec3Si32(rx + x_, ry + y_, rz + z_); }
-		Tile* At(Vec3Si32 w);
+		const Tile* At(Vec3Si32 w) const;
 
 		// inverse transform
 		Si32 PlatformX(Si32 wx) const { return wx - x_; }
@@ -190,13 +197,17 @@ namespace pilecode {
 		Si32 PlatformZ(Si32 wz) const { return wz - z_; }
 
 		// utility
-		void ForEachTile(std::function<void(Vec3Si32, Tile*)> func);
-		void SaveTo(std::ostream& s) const;
-		void LoadFrom(std::istream& s);
+		void ForEachTile(std::function<void(Vec3Si32, const Tile*)> func) const;
+		void SaveTo(BinaryWriter& s) const;
+		void SaveTiles(BinaryWriter& s) const;
+		bool LoadFrom(BinaryReader& s);
+		void LoadLegacy(std::istream& s);
 
 		// accessors
 		Si32 index() const { return index_; }
 		void set_index(Si32 index) { index_ = index; }
+		Si32 w() const { return w_; }
+		Si32 h() const { return h_; }
 
 	private:
 		Si32 index_;
@@ -208,7 +219,9 @@ namespace pilecode {
 		Si32 w_;
 		Si32 h_;
 
-		std::vector<Tile> tiles_;
+		std::shared_ptr<std::vector<Tile>> tiles_; // shared by clones until changed
+		Si32 mismatches_ = 0; // number of tiles with letter different from output
+		std::shared_ptr<const std::vector<Ui16>> ceilings_; // World::Ceiling() of every tile, built on first draw
 	};
 
 	class Robot {
@@ -231,30 +244,37 @@ namespace pilecode {
 
 		// simulation
 		void SimulateExec(World* world);
-		void PrepareMove(World* world);
-		static size_t ResolveMove(Robot* r1, Robot* r2);
-		void StopMove();
-		void SimulateMove(World* world);
+		void SimulateMove(World* world, Vec3Si32 next);
+		void SimulateStop() { px_ = x_; py_ = y_; }
+		bool IsIdle(const World* world) const;
+		void Cruise(Si32 steps);
 
 		// utility
-		Robot* Clone() const;
 		Vec2Si32 d_pos() const;
 		Vec2Si32 dir_delta() const;
-		void SaveTo(std::ostream& s) const;
-		void LoadFrom(std::istream& s);
+		Ui64 StateHash() const;
+		bool operator==(const Robot& other) const;
+		bool operator!=(const Robot& other) const { return !(*this == other); }
+		void SaveTo(BinaryWriter& s) const;
+		bool LoadFrom(BinaryReader& s);
+		void LoadLegacy(std::istream& s);
 		
 		// accessors
 		Si32 priority() const { return priority_; }
-		Si32 set_priority() const { return priority_; }
+		void set_priority(Si32 priority) { priority_ = priority; }
 		Si32 platform() const { return platform_; }
 		Si32 x() const { return x_; }
 		Si32 y() const { return y_; }
+		Direction dir() const { return dir_; }
+		Direction heading() const { return blocked_ || executing_ ? kDirHalt : dir_; } // direction to move in next
+		bool blocked() const { return blocked_; }
+		Si32 executing() const { return executing_; }
 	private:
 		void CalculatePosition(ViewPort* vp, Vec3Si32& w, Vec2Si32& off, Si32& body_off_y) const;
 	private:
 		// robot configuration
 		Si32 seed_;
-		Si32 priority_;
+		Si32 priority_ = 0;
 
 		// robot is currently on this platform
 		Si32 platform_;
@@ -270,10 +290,40 @@ namespace pilecode {
 		Letter reg_ = kLtSpace; // robot has one register that can hold a letter
 		bool blocked_ = false; // robot blocks if it cannot execute current instruction
 		Si32 executing_ = 0;
+	};
+
+	// Receives side effects of simulation (e.g. to play sounds)
+	class WorldEvents {
+	public:
+		virtual ~WorldEvents() {}
+		virtual void OnRead(Robot* robot, Vec3Si32 w, Letter letter) {}
+		virtual void OnWrite(Robot* robot, Vec3Si32 w, Letter letter) {}
+	};
+
+	// Change of tile made by simulation
+	struct TileChange {
+		Si32 platform;
+		Vec3Si32 w;
+		Tile before;
+		Tile after;
+	};
 
-		// simulation intermediates (not serializable)
-		Vec3Si32 curr_;
-		Vec3Si32 next_;
+	// Change of robot state made by simulation
+	struct RobotChange {
+		Si32 index;
+		Robot before;
+		Robot after;
+	};
+
+	// Receives changes made by every step of simulation (e.g. to update views incrementally)
+	class WorldListener {
+	public:
+		virtual ~WorldListener() {}
+		// tiles and robots changed by step, undo, redo or loaded step (valid only during the call)
+		virtual void OnChanges(const World& world, const std::vector<TileChange>& tiles,
+			const std::vector<RobotChange>& robots) = 0;
+		// world was edited or loaded, so everything could be changed
+		virtual void OnEdit(const World& world) {}
 	};
 
 	class World {
@@ -283,338 +333,193 @@ namespace pilecode {
 
 		// rendering
 		void Draw(ViewPort* vp);
+		void DrawTile(ViewPort* vp, Vec3Si32 w); // static commands of cell `w'
 
 		// construction
 		void AddPlatform(Platform* platform);
-		void AddRobot(Robot* robot);
+		void AddRobot(const Robot& robot);
 		Result<Letter> SetLetter(Vec3Si32 w, Letter letter);
 		void SwitchRobot(Vec3Si32 w, const Robot& original);
-		bool IsTouched(Vec3Si32 w);
+		bool IsTouched(Vec3Si32 w) const;
 		bool IsLetterAllowed(Letter letter);
 		void AllowLetter(Letter letter);
 
 		// simulation
 		void Simulate();
+		size_t Advance(size_t maxSteps);
+		Letter ReadCommand(Si32 platform, Vec3Si32 w);
 		bool ReadLetter(Vec3Si32 w, Letter& letter);
 		bool WriteLetter(Vec3Si32 w, Letter letter);
-		bool IsMovable(Vec3Si32 w);
+		bool IsReadable(Vec3Si32 w) const;
+		bool IsWritable(Vec3Si32 w) const;
+		bool IsMovable(Vec3Si32 w) const;
+		bool IsSolid(Vec3Si32 w) const;
+		Ui16 Ceiling(Vec3Si32 w) const;
+		bool IsRobotIn(Vec3Si32 w1, Vec3Si32 w2) const;
+
+		// history
+		void SetJournalLimit(size_t bytes); // record steps to be undone within memory limit (0 to disable)
+		bool Undo(); // returns false iff there is no recorded step to undo
+		bool Redo(); // returns false iff there is no undone step to redo
 
 		// utility
 		World* Clone() const;
-		Platform* FindPlatform(Vec3Si32 w);
-		bool IsOutputCorrect();
-		Tile* At(Vec3Si32 w);
-		void ForEachTile(std::function<void(Vec3Si32, Tile*)> func);
+		Platform* FindPlatform(Vec3Si32 w) const;
+		bool IsOutputCorrect() const;
+		const Tile* At(Vec3Si32 w) const;
+		void ForEachTile(std::function<void(Vec3Si32, const Tile*)> func) const;
+		void SaveTo(BinaryWriter& s) const; // versioned container, see pilecode.cpp
+		bool LoadFrom(BinaryReader& s); // returns false iff data is malformed
+		void SaveStep(BinaryWriter& s) const; // only state changed by simulation, see pilecode.cpp
+		bool LoadStep(BinaryReader& s); // loads other step of the same simulation keeping history
 		void SaveTo(std::ostream& s) const;
-		void LoadFrom(std::istream& s);
+		bool LoadFrom(std::istream& s); // also migrates saves in legacy format
+		void LoadLegacy(std::istream& s);
         void SaveToText(std::ostream& s) const; // TODO
         void LoadFromText(std::istream& s); // TODO
 
 		// accessors
 		Platform* platform(Si32 i) const { return platform_[i].get(); }
-		Robot* robot(Si32 i) const { return robot_[i].get(); }
+		Si32 platforms() const { return Si32(platform_.size()); }
+		Robot* robot(Si32 i) { return &robot_[i]; }
+		const Robot* robot(Si32 i) const { return &robot_[i]; }
+		Si32 robots() const { return Si32(robot_.size()); }
 		WorldParams& params() { return wparams_; }
 		size_t steps() const { return steps_; }
+		size_t undoable() const { return journalStep_; } // recorded steps that can be undone
+		size_t redoable() const { return journal_.size() - journalStep_; } // undone steps that can be redone
+		Ui64 hash() const { return hash_; } // hash of simulation state
+		size_t loop() const { return loop_; } // period of detected state loop (0 if none), could be its multiple after Advance()
+		bool stalled() const { return loop_ == 1; } // last step changed nothing
+		const Bitboard& movable(Si32 z) const { return (*layers_)[z].movable; }
+		const Bitboard& modifiable(Si32 z) const { return (*layers_)[z].modifiable; }
+		const Bitboard& solid(Si32 z) const { return (*layers_)[z].solid; }
+		const Bitboard& occupied(Si32 z) const { return occupied_[z]; } // cells with robots
+		WorldEvents* events() const { return events_; }
+		void set_events(WorldEvents* events) { events_ = events; } // not cloned
+		void AddListener(WorldListener* listener); // not cloned
+		void RemoveListener(WorldListener* listener);
+		// checks every Simulate() step against reference O(n^2) move resolution (slow, not cloned)
+		void set_check_moves(bool check) { checkMoves_ = check; }
+		size_t move_mismatches() const { return moveMismatches_; } // steps resolved differently
+		// resolves moves of every Simulate() step with reference O(n^2) algorithm instead (slow, not cloned)
+		void set_reference_moves(bool reference) { referenceMoves_ = reference; }
+		// simulates every robot in every step and never jumps, as reference for sleeping and jumps (slow, not cloned)
+		void set_simulate_all(bool all) { simulateAll_ = all; WakeAll(); }
+	private:
+		// index of platforms covering world cell
+		struct CellIndex {
+			Si32 cover = -1; // first platform with cell inside its bounds
+			Si32 owner = -1; // first platform with non-empty tile in cell
+		};
+		// bitboards of cells in z-level for range queries
+		struct Layer {
+			Bitboard movable; // covering tile is movable
+			Bitboard modifiable; // covering tile is modifiable
+			Bitboard solid; // cell has non-empty tile
+		};
+		void PrepareMoves();
+		void ResolveMoves();
+		void ResolveMovesPairwise(std::vector<Si32>& next) const;
+		Ui64 TileHash(Si32 platform, Vec3Si32 w, const Tile& tile) const;
+		Ui64 RobotHash(Si32 i, const Robot& robot) const;
+		void HashPlatform(Platform* platform);
+		void Rehash();
+		void ResetLoop();
+		void DetectLoop(Ui64 prevHash);
+		void TileChanged(Si32 platform, Vec3Si32 w, const Tile& before, const Tile& after);
+		void ClearJournal();
+		bool IsRecording() const { return journalLimit_ || !listeners_.empty(); }
+		void NotifyChanges();
+		void OnEdit();
+		bool ReadContainer(BinaryReader& s);
+		bool LoadPayload(BinaryReader& s);
+		void Loaded();
+		size_t JumpLength(size_t maxSteps);
+		void Jump(size_t steps);
+		Ui16 RunLength(Si32 platform, Si32 rx, Si32 ry, Si32 dir) const;
+		void IndexRuns(Si32 platform);
+		void UpdateRuns(Si32 platform, Vec3Si32 w);
+		bool Sleep(Si32 i);
+		void Wake(Si32 cell);
+		void WakeAll();
+		void ResetIndex();
+		void IndexRobots();
+		void IndexPlatform(Platform* platform);
+		void IndexExits();
+		const CellIndex* Cell(Vec3Si32 w) const;
+		Tile* CoverTile(Vec3Si32 w);
+		const Tile* CoverTile(Vec3Si32 w) const;
+		Tile* OwnerTile(Vec3Si32 w);
+		const Tile* OwnerTile(Vec3Si32 w) const;
 	private:
 		WorldParams wparams_;
+		std::shared_ptr<std::vector<CellIndex>> cells_; // indexed by WorldParams::index(), shared by clones
+		std::shared_ptr<std::vector<Layer>> layers_; // indexed by z, shared by clones
+		std::shared_ptr<std::vector<Ui8>> exits_; // per cell: bit `dir' is set iff robot can move in direction `dir', built on first step
+		std::vector<Bitboard> occupied_; // cells with robots, indexed by z
 		std::vector<std::shared_ptr<Platform>> platform_;
-		std::vector<std::shared_ptr<Robot>> robot_;
+		std::vector<Robot> robot_; // stored by value to be simulated without indirection
 		bool isLetterAllowed_[kLtMax];
 		size_t steps_ = 0;
-	};
-
-	struct Pos {
-		// world to screen representation parameters
-		static Si32 dx;
-		static Si32 dy;
-		static Si32 dz;
-
-		// screen coordinates
-		Si32 x;
-		Si32 y;
-
-		// world coordinates
-		Si32 wx;
-		Si32 wy;
-		Si32 wz;
-
-		Pos(Si32 _wx, Si32 _wy, Si32 _wz)
-			: x(dx * (_wy - _wx))
-			, y(-dy * (_wx + _wy) + dz *_wz)
-			, wx(_wx), wy(_wy), wz(_wz)
-		{}
-
-		explicit Pos(Vec2Si32 w)
-			: Pos(w.x, w.y, 0)
-		{}
-
-		explicit Pos(Vec3Si32 w)
-			: Pos(w.x, w.y, w.z)
-		{}
-
-		void Up()
-		{
-			wy++;
-			x += dx;
-			y -= dy;
-		}
-
-		void Down()
-		{
-			wy--;
-			x -= dx;
-			y += dy;
-		}
-
-		void Right()
-		{
-			wx++;
-			x -= dx;
-			y -= dy;
-		}
-
-		void Left()
-		{
-			wx--;
-			x += dx;
-			y += dy;
-		}
-
-		void Ceil()
-		{
-			wz++;
-			y += dz;
-		}
-
-		void Floor()
-		{
-			wz--;
-			y -= dz;
-		}
-
-		Vec3Si32 World() const
-		{
-			return Vec3Si32(wx, wy, wz);
-		}
-
-		Vec2Si32 Screen() const
-		{
-			return Vec2Si32(x, y);
-		}
-
-		static Vec2Si32 ToScreen(Vec2Si32 w)
-		{
-			return Pos(w).Screen();
-		}
-
-		static Vec2Si32 ToScreen(Vec3Si32 w)
-		{
-			return Pos(w).Screen();
-		}
-
-		static Vec3Si32 ToWorld(Vec2Si32 s, Si32 wz)
-		{
-			s.y -= dz * wz;
-			Si32 wx = Si32(-(float(s.x) / dx + float(s.y) / dy) / 2.0f);
-			Si32 wy = Si32( (float(s.x) / dx - float(s.y) / dy) / 2.0f);
-
-			return Vec3Si32(wx, wy, wz);
-		}
-
-		static Vec2F ToTile(Vec2Si32 s)
-		{
-			float wx = -(float(s.x) / dx + float(s.y) / dy) / 2.0f;
-			float wy =  (float(s.x) / dx - float(s.y) / dy) / 2.0f;
-
-			return Vec2F(wx, wy);
-		}
-	};
-
-	class ViewPort {
-	public:
-		struct RenderCmnd;
-		friend struct RenderCmnd;
-		struct RenderList;
-		class EventHandling;
-
-	public:
-		enum EventPassing {
-			kBlock = 0, // blocks further event passing (e.g. tile brick)
-			kPass = 1, // pass event further (e.g. shadow)
-			kInteract = 2, // calls event handler (e.g. robot)
-		};
-
-		struct RenderCmnd {
-			enum Type {
-				kSprite = 0,
-				kSpriteRgba = 1,
-				kShadow = 2,
-			};
-
-			enum Filter {
-				kFilterNone = 0,
-				kFilterTransparent,
-			};
-
-			Type type_;
-
-			// for kSprite and kSpriteRgba
-			Sprite* sprite_ = nullptr;
-			Vec2Si32 off_ = Vec2Si32(0, 0);
-			Rgba blend_ = Rgba(Ui32(0));
-			Ui8 opacity_ = 0xff;
-
-			// for kShadow
-			Shadow shadow_;
-
-			// for event handling
-			EventPassing passing_ = kBlock;
-			Ui64 tag_ = 0;
-			void* data_ = nullptr;
-		public:
-			RenderCmnd(Type type, Sprite* sprite, Vec2Si32 off_);
-			explicit RenderCmnd(const Shadow& shadow);
-
-			RenderCmnd& Blend(Rgba rgba);
-			RenderCmnd& Alpha();
-			RenderCmnd& Opacity(Ui8 value);
-			RenderCmnd& Interactive(Ui64 tag = 0, void* data = nullptr);
-			RenderCmnd& PassEventThrough();
-		private:
-			void Apply(ViewPort* vp, Si32 x, Si32 y, Filter filter);
-			bool IsHit(Vec2Si32 s, const EventHandling& eh, Ui8 alphaThreshold = 0x80);
-			friend class ViewPort;
-		};
-
-		struct RenderList {
-			std::vector<RenderCmnd> next;
-			std::vector<RenderCmnd> prev;
-
-			void EndRender()
-			{
-				prev.clear();
-				std::swap(next, prev);
-			}
-		};
-
-		class EventHandling {
-		public:
-			explicit EventHandling(ViewPort* vp)
-				: vp_(vp)
-				, p_(0, 0, 0)
-			{}
-			void StopPropagate() { propagate_ = false; }
-			ViewPort* vp() const { return vp_; }
-			Pos p() const { return p_; }
-			Si32 zl() const { return zl_; }
-		private:
-			ViewPort* vp_;
-			Pos p_;
-			Si32 zl_;
-			bool propagate_ = true;
-			friend class ViewPort;
+		WorldEvents* events_ = nullptr;
+
+		// state hashing and loop detection (not serializable)
+		Ui64 hash_ = 0; // xor of hashes of all tiles within world and robots
+		Ui64 loopHash_ = 0; // state hash checkpoint
+		size_t loopStep_ = 0; // step of checkpoint
+		size_t loopPower_ = 1; // steps between checkpoints
+		size_t loop_ = 0;
+
+		// sleep/wake scheduling of idle robots (not serializable)
+		std::vector<Si32> active_; // sorted indices of robots that are awake
+		std::vector<Si32> sleep_; // cell robot sleeps in (-1 if awake)
+		std::vector<Si32> sleeper_; // robot sleeping in cell (-1 if none), allocated on first use
+		std::vector<Si32> woken_; // robots to be awaken after current step
+		Si32 simulating_ = -1; // robot executing its command (-1 if none)
+
+		// macro stepping (not serializable)
+		// per platform: number of steps robot can move straight ahead in every direction
+		// from every tile without reading any letter (4 values per tile, empty until used)
+		std::vector<std::vector<Ui16>> runs_;
+
+		// changes made by last step (not serializable)
+		std::vector<WorldListener*> listeners_;
+		std::vector<TileChange> stepTiles_; // reused to avoid allocation on every step
+		std::vector<RobotChange> stepRobots_;
+		std::vector<Robot> robotsBefore_; // state of awake robots before step
+
+		// undo journal (not serializable)
+		struct StepRecord {
+			size_t tiles; // number of tile changes made by step
+			size_t robots; // number of robot changes made by step
+			Ui64 hashBefore;
+			Ui64 hashAfter;
 		};
-
-	public:
-		explicit ViewPort(World* world);
-
-		// drawing
-		RenderCmnd::Filter FilterMode(Si32 wz);
-		RenderCmnd* GetRenderCmnd(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz);
-		RenderCmnd* GetRenderCmnd(Sprite* sprite, Vec3Si32 w);
-		RenderCmnd& Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl, Vec2Si32 off);
-		RenderCmnd& Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl);
-		RenderCmnd& Draw(Sprite* sprite, Vec3Si32 w, Si32 zl, Vec2Si32 off);
-		RenderCmnd& Draw(Sprite* sprite, Vec3Si32 w, Si32 zl);
-		RenderCmnd& DrawShadow(Si32 wx, Si32 wy, Si32 wz, Si32 zl);
-
-		// rendering
-		void BeginRender(double time);
-		void EndRender(bool drawCeiling, Vec3Si32 w);
-
-		// backtrack
-		void Event(Vec2Si32 s, std::function<void(EventHandling& eh, Ui64 tag, void* data)> handler);
-
-		// navigation
-		void Move(Vec2F delta);
-		void MoveNoClamp(Vec2F delta);
-		void Locate(Vec2F loc);
-		void Center();
-		void IncVisibleZ();
-		void DecVisibleZ();
-        void SetVisibleZ(Si32 z);
-        Si32 visible_z() const { return visible_z_; }
-
-		// simulation support
-		double progress() const { return progress_; }
-		void set_progress(double progress) { progress_ = progress; }
-
-		// transformations
-		Vec3Si32 ToWorldAtZ(Si32 wz, Vec2Si32 p) const;
-		Vec3Si32 ToWorldTileAtZ(Si32 wz, Vec2Si32 p, Vec2F& tp) const;
-		bool ToWorld(Vec2Si32 p, Vec3Si32& w) const;
-		bool ToWorldTile(Vec2Si32 p, Vec3Si32& w, Vec2F& tp) const;
-
-		// world-related
-		World* world() const { return world_; }
-		void set_world(World* world) { world_ = world; }
-
-	private:
-		void ApplyCommands();
-		void DrawCeiling(Vec3Si32 w);
-
-		Pos GetPos(Si32 wx, Si32 wy, Si32 wz = 0);
-		Sprite ShadowMask(Sprite& surfaceMask, const Shadow& shadow);
-
-		Sprite transparent() { return transparent_; }
-		RenderList& renderList(Si32 wx, Si32 wy, Si32 wz, Si32 zl)
-		{
-			if (!(zl >= 0 && zl < zlSize)) {
-				abort();
-			}
-			return cmnds_[wparams_.index(wx, wy, (wz << zlBits) + zl)];
-		}
-
-	private:
-		// world
-		WorldParams wparams_;
-		World* world_ = nullptr;
-
-		// screen offset in pixels
-		float x_ = 0;
-		float y_ = 0;
-		float xmin_ = 0;
-		float ymin_ = 0;
-		float xmax_ = 0;
-		float ymax_ = 0;
-
-		// world rendering parameters
-		Si32 visible_z_ = 0;
-		Si32 drawn_z_ = 0; // z-layers drawn in current frame
-
-		// time-related
-		double lastFrameTime_ = 0.0;
-		double curFrameTime_ = 0.0;
-		double progress_ = 1.0; // 0 - previous world state, 1 - current world state 
-
-		// rendering artifacts
-		static constexpr size_t zlBits = 2ull;
-		static constexpr size_t zlSize = 1ull << zlBits;
-		std::vector<RenderList> cmnds_;
-		Sprite transparent_;
+		size_t journalLimit_ = 0; // in bytes
+		std::deque<StepRecord> journal_; // steps [0, journalStep_) can be undone, the rest can be redone
+		std::deque<TileChange> journalTiles_;
+		std::deque<RobotChange> journalRobots_;
+		size_t journalStep_ = 0;
+		size_t journalTile_ = 0; // first tile change of step journalStep_
+		size_t journalRobot_ = 0; // first robot change of step journalStep_
+
+		// move phase state in structure-of-arrays form, indexed by robot (not serializable)
+		// cells are WorldParams::index() of robot positions, so moves are resolved without Robot access
+		std::vector<Si32> cell_; // cell robot stands in
+		std::vector<Si32> next_; // cell robot moves into (equals cell_ if robot stays)
+		std::vector<Ui8> heading_; // Robot::heading() after command execution
+		std::vector<Si32> priority_; // Robot::priority(), copied by IndexRobots()
+
+		// move resolution intermediates (not serializable)
+		std::vector<Si32> occupant_; // robot standing in cell (-1 if none)
+		std::vector<Si32> claim_; // robot allowed to move into cell (-1 if none)
+		std::vector<Si32> resolution_; // robot state while resolving moves
+		std::vector<Si32> chain_;
+		bool checkMoves_ = false;
+		bool referenceMoves_ = false;
+		bool simulateAll_ = false;
+		size_t moveMismatches_ = 0;
+		std::vector<Si32> reference_; // next_ resolved by ResolveMovesPairwise()
 	};
-
-	template <class T>
-	void Save(std::ostream& os, const T& t)
-	{
-		// works fine for PODs if you dont bother about endians
-		os.write(reinterpret_cast<const char*>(&t), sizeof(T));
-	}
-
-	template <class T>
-	void Load(std::istream& is, T& t)
-	{
-		// works fine for PODs if you dont bother about endians
-		is.read(reinterpret_cast<char*>(&t), sizeof(T));
-	}
 }
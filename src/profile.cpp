@@ -0,0 +1,629 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace pilecode {
+
+	// Profile is magic, version, generation, levels count, size of every saved world (all u32)
+	// and saved worlds, so any level can be found without decoding the others
+	// Legacy profiles (raw size_t count and worlds written before versioning) are migrated on load
+	static const char kProfileMagic[4] = { 'P', 'C', 'P', 'F' };
+	static const Ui32 kProfileVersion = 1;
+	static const size_t kProfileHeader = 16;
+
+	// Journal is magic, version, generation of profile it applies to and records:
+	// varint level, varint size, checksum (u32) and saved world
+	static const char kJournalMagic[4] = { 'P', 'C', 'P', 'J' };
+	static const Ui32 kJournalVersion = 1;
+
+	static const size_t kMaxQueue = 16; // levels waiting to be appended to journal
+	static const size_t kCompactRecords = 64; // journal size that triggers compaction
+
+	static std::string JournalPath(const std::string& path)
+	{
+		return path + ".journal";
+	}
+
+	static std::string TempPath(const std::string& path)
+	{
+		return path + ".tmp";
+	}
+
+	// FNV-1a
+	static Ui32 Checksum(const char* data, size_t size)
+	{
+		Ui32 h = 2166136261u;
+		for (size_t i = 0; i < size; i++) {
+			h = (h ^ Ui8(data[i])) * 16777619u;
+		}
+		return h;
+	}
+
+	static bool HasMagic(BinaryReader& r, const char (&magic)[4])
+	{
+		const char* p = r.ReadBytes(sizeof(magic));
+		return p && std::equal(magic, magic + sizeof(magic), p);
+	}
+
+	static std::string ProfileData(const std::vector<std::string>& levels, Ui32 generation)
+	{
+		BinaryWriter w;
+		w.WriteBytes(kProfileMagic, sizeof(kProfileMagic));
+		w.WriteU32(kProfileVersion);
+		w.WriteU32(generation);
+		w.WriteU32(Ui32(levels.size()));
+		for (const std::string& l : levels) {
+			w.WriteU32(Ui32(l.size()));
+		}
+		for (const std::string& l : levels) {
+			w.WriteBytes(l.data(), l.size());
+		}
+		return std::move(w.data());
+	}
+
+	// Rename is atomic on POSIX, elsewhere old file has to be removed first
+	// and LoadFromDisk() falls back to temporary file if crashed in between
+	static bool ReplaceFile(const std::string& from, const std::string& to)
+	{
+		if (std::rename(from.c_str(), to.c_str()) == 0) {
+			return true;
+		}
+		std::remove(to.c_str());
+		return std::rename(from.c_str(), to.c_str()) == 0;
+	}
+
+	// Writes (or appends) data and flushes it through caches of OS to disk
+	static bool WriteDurable(const std::string& path, const std::string& data, bool append)
+	{
+		FILE* f = std::fopen(path.c_str(), append ? "ab" : "wb");
+		if (!f) {
+			return false;
+		}
+		bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size() && std::fflush(f) == 0;
+#ifdef _WIN32
+		ok = ok && _commit(_fileno(f)) == 0;
+#else
+		ok = ok && fsync(fileno(f)) == 0;
+#endif
+		return std::fclose(f) == 0 && ok;
+	}
+
+	// Flushes directory entries of directory containing `path' (created or renamed files) to disk
+	// Windows has no such call, its rename is durable only as far as NTFS journal is
+	static void SyncDirectory(const std::string& path)
+	{
+#ifndef _WIN32
+		size_t slash = path.find_last_of('/');
+		std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+		int fd = open(dir.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+#endif
+	}
+
+	static bool FileExists(const std::string& path)
+	{
+		return std::ifstream(path).good();
+	}
+
+	// Reads `size' bytes at `offset', returns empty string on failure
+	static std::string ReadAt(std::istream& s, Ui64 offset, Ui32 size)
+	{
+		std::string data(size, '\0');
+		s.seekg(std::streamoff(offset));
+		s.read(&data[0], size);
+		if (!s || s.gcount() != std::streamsize(size)) {
+			s.clear();
+			data.clear();
+		}
+		return data;
+	}
+
+	ProfileWriter::ProfileWriter(const std::string& path, std::vector<Saved> levels,
+		Ui32 generation, size_t journalRecords, bool journalDamaged)
+		: path_(path)
+		, levels_(std::move(levels))
+		, generation_(generation)
+		, journalRecords_(journalRecords)
+		, journalDamaged_(journalDamaged)
+	{}
+
+	ProfileWriter::~ProfileWriter()
+	{
+		if (!thread_.joinable()) {
+			return; // nothing was written
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		wake_.notify_one();
+		thread_.join();
+	}
+
+	std::string ProfileWriter::Read(size_t level)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (level >= levels_.size()) {
+			return std::string();
+		}
+		Saved& saved = levels_[level];
+		if (saved.data.empty() && saved.size) {
+			// profile file is not replaced while some level is not in memory
+			std::ifstream ifs(path_, std::ios::binary);
+			saved.data = ReadAt(ifs, saved.offset, saved.size);
+			if (!saved.data.empty()) {
+				saved.size = 0;
+			}
+		}
+		return saved.data;
+	}
+
+	void ProfileWriter::Write(size_t level, std::string data)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			Saved saved;
+			saved.data = std::move(data);
+			if (level == levels_.size()) {
+				levels_.push_back(std::move(saved));
+			}
+			else if (level < levels_.size()) {
+				levels_[level] = std::move(saved);
+			}
+			else {
+				return;
+			}
+			Start();
+			if (!compact_ && std::find(queue_.begin(), queue_.end(), level) == queue_.end()) {
+				if (queue_.size() < kMaxQueue) {
+					queue_.push_back(level);
+				}
+				else {
+					// instead of waiting for disk write everything at once
+					compact_ = true;
+					queue_.clear();
+				}
+			}
+		}
+		wake_.notify_one();
+	}
+
+	void ProfileWriter::Compact()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			compact_ = true;
+			queue_.clear();
+			Start();
+		}
+		wake_.notify_one();
+	}
+
+	// Should be called with mutex_ locked
+	void ProfileWriter::Start()
+	{
+		if (!thread_.joinable()) {
+			thread_ = std::thread(&ProfileWriter::Run, this);
+		}
+	}
+
+	void ProfileWriter::Flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this] { return queue_.empty() && !compact_ && !busy_; });
+	}
+
+	void ProfileWriter::Run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true) {
+			wake_.wait(lock, [this] { return stop_ || compact_ || !queue_.empty(); });
+			if (!compact_ && queue_.empty()) {
+				break; // stopped with nothing left to write
+			}
+
+			// take a snapshot of work and do io without lock
+			bool compact = compact_ || journalDamaged_ || journalRecords_ + queue_.size() > kCompactRecords;
+			std::vector<std::pair<size_t, std::string>> records;
+			if (!compact) {
+				for (size_t level : queue_) {
+					records.emplace_back(level, levels_[level].data);
+				}
+			}
+			queue_.clear();
+			compact_ = false;
+			busy_ = true;
+			lock.unlock();
+
+			if (compact) {
+				std::vector<std::string> levels;
+				if (Resolve(levels)) {
+					WriteProfile(levels);
+				}
+			}
+			else {
+				AppendJournal(records);
+			}
+			bool retry = !compact && journalDamaged_;
+
+			lock.lock();
+			busy_ = false;
+			if (retry) {
+				compact_ = true; // failed records are only in memory now
+			}
+			if (queue_.empty() && !compact_) {
+				idle_.notify_all();
+			}
+		}
+		idle_.notify_all();
+	}
+
+	// Reads levels that are not in memory yet and takes a snapshot of all levels
+	bool ProfileWriter::Resolve(std::vector<std::string>& levels)
+	{
+		std::vector<std::pair<size_t, Saved>> pending;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (size_t i = 0; i < levels_.size(); i++) {
+				if (levels_[i].data.empty() && levels_[i].size) {
+					pending.emplace_back(i, levels_[i]);
+				}
+			}
+		}
+		if (!pending.empty()) {
+			std::ifstream ifs(path_, std::ios::binary);
+			for (auto& p : pending) {
+				p.second.data = ReadAt(ifs, p.second.offset, p.second.size);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto& p : pending) {
+			Saved& saved = levels_[p.first];
+			if (saved.data.empty() && saved.size && !p.second.data.empty()) {
+				saved.data = std::move(p.second.data); // was not read or written meanwhile
+				saved.size = 0;
+			}
+		}
+		levels.clear();
+		for (const Saved& saved : levels_) {
+			if (saved.data.empty() && saved.size) {
+				return false; // unable to read, keep old profile
+			}
+			levels.push_back(saved.data);
+		}
+		return true;
+	}
+
+	void ProfileWriter::AppendJournal(const std::vector<std::pair<size_t, std::string>>& records)
+	{
+		BinaryWriter w;
+		if (journalRecords_ == 0) {
+			// start new journal (old one is either missing, damaged or outdated)
+			w.WriteBytes(kJournalMagic, sizeof(kJournalMagic));
+			w.WriteU32(kJournalVersion);
+			w.WriteU32(generation_);
+		}
+		for (const auto& record : records) {
+			w.WriteVar(record.first);
+			w.WriteVar(record.second.size());
+			w.WriteU32(Checksum(record.second.data(), record.second.size()));
+			w.WriteBytes(record.second.data(), record.second.size());
+		}
+		// record is not reported as saved until it is on disk
+		if (WriteDurable(JournalPath(path_), w.data(), journalRecords_ != 0)) {
+			if (journalRecords_ == 0) {
+				SyncDirectory(JournalPath(path_));
+			}
+			journalRecords_ += records.size();
+		}
+		else {
+			// Partially written record would hide everything appended after it from
+			// ReplayJournal(), so journal is not appended until profile is rewritten
+			journalDamaged_ = true;
+		}
+	}
+
+	// Journal is not needed after profile is replaced: its records are either
+	// in new profile or ignored due to generation mismatch if crashed before removal
+	// New profile is on disk before rename, and rename is on disk before journal is removed,
+	// so power loss at any moment leaves either old profile with journal or new profile
+	void ProfileWriter::WriteProfile(const std::vector<std::string>& levels)
+	{
+		std::string data = ProfileData(levels, generation_ + 1);
+		if (!WriteDurable(TempPath(path_), data, false)) {
+			return;
+		}
+		if (!ReplaceFile(TempPath(path_), path_)) {
+			return;
+		}
+		SyncDirectory(path_);
+		generation_++;
+		journalRecords_ = 0;
+		journalDamaged_ = false;
+		std::remove(JournalPath(path_).c_str());
+	}
+
+	PlayerProfile::PlayerProfile(const std::string& path)
+		: path_(path)
+		, writer_(new ProfileWriter(path, std::vector<ProfileWriter::Saved>(), 0, 0, false))
+	{}
+
+	World* PlayerProfile::GetSavedWorld(int level)
+	{
+		World* world = IsLevelAvailable(level) ? Decode(level) : nullptr;
+		return world ? world->Clone() : nullptr;
+	}
+
+	void PlayerProfile::UpdateLevel(int level, World* world)
+	{
+		if (IsLevelAvailable(level)) {
+			level_[level] = std::shared_ptr<World>(world);
+			Persist(level);
+		}
+	}
+
+	void PlayerProfile::AddLevel(int level, World* world)
+	{
+		if (size_t(level) == level_.size()) {
+			level_.emplace_back(world);
+			Persist(level);
+		}
+	}
+
+	void PlayerProfile::SaveTo(std::ostream& s) const
+	{
+		std::vector<std::string> levels;
+		for (size_t i = 0; i < level_.size(); i++) {
+			levels.push_back(writer_->Read(i));
+		}
+		std::string data = ProfileData(levels, generation_);
+		s.write(data.data(), data.size());
+	}
+
+	bool PlayerProfile::LoadFrom(std::istream& s)
+	{
+		writer_.reset();
+		std::vector<ProfileWriter::Saved> saved;
+		bool loaded = Parse(ReadAll(s), saved);
+		writer_.reset(new ProfileWriter(path_, std::move(saved), generation_, 0, false));
+		return loaded;
+	}
+
+	// Decodes all saved worlds of profile in any format
+	bool PlayerProfile::Parse(const std::string& data, std::vector<ProfileWriter::Saved>& saved)
+	{
+		level_.clear();
+		saved.clear();
+		generation_ = 0;
+		BinaryReader r(data);
+		if (!HasMagic(r, kProfileMagic)) {
+			return ParseLegacy(data, saved);
+		}
+		Ui32 version = r.ReadU32();
+		generation_ = r.ReadU32();
+		Ui64 levels = r.ReadU32();
+		if (r.failed() || version != kProfileVersion || levels > r.left()) {
+			return false;
+		}
+		r.ReadBytes(size_t(levels) * 4); // saved worlds follow each other, index is not needed
+		saved.resize(size_t(levels));
+		level_.resize(size_t(levels));
+		for (size_t i = 0; i < level_.size(); i++) {
+			const char* begin = r.pos();
+			level_[i].reset(new World());
+			if (!level_[i]->LoadFrom(r)) {
+				level_.clear();
+				saved.clear();
+				return false;
+			}
+			saved[i].data.assign(begin, r.pos());
+		}
+		return true;
+	}
+
+	bool PlayerProfile::ParseLegacy(const std::string& data, std::vector<ProfileWriter::Saved>& saved)
+	{
+		std::istringstream s(data);
+		size_t levels;
+		Load<size_t>(s, levels);
+		if (!s || levels > data.size()) {
+			return false;
+		}
+		saved.resize(levels);
+		level_.resize(levels);
+		for (size_t i = 0; i < levels; i++) {
+			level_[i].reset(new World());
+			level_[i]->LoadLegacy(s);
+			BinaryWriter w;
+			level_[i]->SaveTo(w);
+			saved[i].data = std::move(w.data());
+		}
+		if (!s) {
+			level_.clear();
+			saved.clear();
+			return false;
+		}
+		return true;
+	}
+
+	// Reads only header and index of profile, saved worlds are left on disk
+	// Legacy profiles have no index and are decoded at once (`migrate' is set)
+	bool PlayerProfile::LoadIndex(std::istream& s, std::vector<ProfileWriter::Saved>& saved, bool& migrate)
+	{
+		s.seekg(0, std::ios::end);
+		Ui64 fileSize = Ui64(s.tellg());
+		std::string header = ReadAt(s, 0, Ui32(std::min<Ui64>(fileSize, kProfileHeader)));
+		BinaryReader r(header);
+		if (!HasMagic(r, kProfileMagic) || r.ReadU32() != kProfileVersion) {
+			s.seekg(0);
+			migrate = true;
+			return Parse(ReadAll(s), saved);
+		}
+		generation_ = r.ReadU32();
+		Ui64 levels = r.ReadU32();
+		if (r.failed() || levels > (fileSize - kProfileHeader) / 4) {
+			return false;
+		}
+		std::string index = ReadAt(s, kProfileHeader, Ui32(levels * 4));
+		BinaryReader ir(index);
+		saved.resize(size_t(levels));
+		Ui64 offset = kProfileHeader + levels * 4;
+		for (auto& l : saved) {
+			l.offset = offset;
+			l.size = ir.ReadU32();
+			offset += l.size;
+		}
+		if (ir.failed() || offset > fileSize) {
+			saved.clear();
+			return false;
+		}
+		level_.resize(size_t(levels));
+		return true;
+	}
+
+	// Applies records appended to journal after profile was written
+	// Stops at first damaged record, which is a write interrupted by crash
+	size_t PlayerProfile::ReplayJournal(std::vector<ProfileWriter::Saved>& saved, bool& damaged)
+	{
+		std::ifstream ifs(JournalPath(path_), std::ios::binary);
+		std::string data = ReadAll(ifs);
+		BinaryReader r(data);
+		if (!HasMagic(r, kJournalMagic) || r.ReadU32() != kJournalVersion || r.ReadU32() != generation_) {
+			return 0;
+		}
+		size_t records = 0;
+		while (r.left()) {
+			Ui64 level = r.ReadVar();
+			Ui64 size = r.ReadVar();
+			Ui32 checksum = r.ReadU32();
+			const char* p = r.failed() || size > r.left() ? nullptr : r.ReadBytes(size_t(size));
+			if (!p || checksum != Checksum(p, size_t(size)) || level > saved.size()) {
+				damaged = true; // e.g. crashed or failed while appending
+				break;
+			}
+			if (level == saved.size()) {
+				saved.emplace_back();
+				level_.emplace_back();
+			}
+			level_[size_t(level)].reset(); // decoded on demand as well
+			saved[size_t(level)] = ProfileWriter::Saved();
+			saved[size_t(level)].data.assign(p, size_t(size));
+			records++;
+		}
+		return records;
+	}
+
+	World* PlayerProfile::Decode(size_t level)
+	{
+		if (!level_[level]) {
+			std::string data = writer_->Read(level);
+			BinaryReader r(data);
+			std::shared_ptr<World> world(new World());
+			if (world->LoadFrom(r)) {
+				level_[level] = world;
+			}
+		}
+		return level_[level].get();
+	}
+
+	// Writes `level' to journal in background
+	void PlayerProfile::Persist(size_t level)
+	{
+		BinaryWriter w;
+		level_[level]->SaveTo(w);
+		writer_->Write(level, std::move(w.data()));
+		if (migrate_) {
+			writer_->Compact(); // rewrite old format with index for lazy loading next time
+			migrate_ = false;
+		}
+	}
+
+	void PlayerProfile::SaveToDisk()
+	{
+		writer_->Compact();
+	}
+
+	bool PlayerProfile::LoadFromDisk()
+	{
+		writer_.reset(); // finish writes of previous profile
+		level_.clear();
+		generation_ = 0;
+		migrate_ = false;
+		if (!FileExists(path_) && FileExists(TempPath(path_))) {
+			ReplaceFile(TempPath(path_), path_); // crashed while replacing profile
+		}
+
+		std::vector<ProfileWriter::Saved> saved;
+		bool loaded = false;
+		bool migrate = false;
+		std::ifstream ifs(path_, std::ios::binary);
+		if (ifs.good()) {
+			loaded = LoadIndex(ifs, saved, migrate);
+		}
+		ifs.close();
+		if (!loaded) {
+			level_.clear();
+			saved.clear();
+			generation_ = 0;
+		}
+
+		bool damaged = false;
+		size_t records = ReplayJournal(saved, damaged);
+		writer_.reset(new ProfileWriter(path_, std::move(saved), generation_, records, damaged));
+		migrate_ = loaded && migrate;
+		return loaded || records > 0;
+	}
+
+	void PlayerProfile::Flush()
+	{
+		writer_->Flush();
+	}
+
+	bool PlayerProfile::IsLevelAvailable(int level) const
+	{
+		return (size_t)level < level_.size();
+	}
+
+	int PlayerProfile::LastAvailableLevel() const
+	{
+		return int(level_.empty() ? 0 : level_.size() - 1);
+	}
+
+}
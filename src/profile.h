@@ -0,0 +1,125 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#pragma once
+
+#include "pilecode.h"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pilecode {
+
+	// Keeps saved worlds of profile and persists them in background thread, so saving never waits for disk
+	// Every saved level is appended to journal file, which is replayed on load and
+	// periodically compacted into new profile file that atomically replaces the old one
+	class ProfileWriter {
+	public:
+		// Saved world (see World::SaveTo) is either in memory or at `offset' of profile file
+		struct Saved {
+			std::string data;
+			Ui64 offset = 0;
+			Ui32 size = 0;
+		};
+
+		// `levels', `journalRecords' and `journalDamaged' describe what is already on disk
+		ProfileWriter(const std::string& path, std::vector<Saved> levels,
+			Ui32 generation, size_t journalRecords, bool journalDamaged);
+		~ProfileWriter(); // finishes pending writes
+
+		std::string Read(size_t level); // reads profile file if level is not in memory yet
+		void Write(size_t level, std::string data);
+		void Compact(); // rewrite profile file and clear journal
+		void Flush(); // waits until everything is written
+
+	private:
+		void Start();
+		void Run();
+		bool Resolve(std::vector<std::string>& levels);
+		void AppendJournal(const std::vector<std::pair<size_t, std::string>>& records);
+		void WriteProfile(const std::vector<std::string>& levels);
+	private:
+		std::string path_;
+		std::thread thread_; // started by first write
+		std::mutex mutex_;
+		std::condition_variable wake_; // there is work to do or stop is requested
+		std::condition_variable idle_; // all work is done
+
+		// guarded by mutex_
+		std::vector<Saved> levels_; // latest saved world of every level
+		std::deque<size_t> queue_; // levels to append to journal, bounded by kMaxQueue
+		bool compact_ = false;
+		bool busy_ = false;
+		bool stop_ = false;
+
+		// owned by writer thread
+		Ui32 generation_; // of profile on disk, journal applies to it
+		size_t journalRecords_;
+		bool journalDamaged_; // journal ends with garbage, so it is compacted instead of appended
+	};
+
+	// Initial worlds (programs) saved by player for every available level
+	// Saved worlds are decoded on first use, so startup does not depend on profile size
+	class PlayerProfile {
+	public:
+		explicit PlayerProfile(const std::string& path = "profile.sav");
+
+		World* GetSavedWorld(int level);
+		void UpdateLevel(int level, World* world);
+		void AddLevel(int level, World* world);
+
+		void SaveTo(std::ostream& s) const;
+		bool LoadFrom(std::istream& s); // returns false iff data is malformed
+		void SaveToDisk(); // asynchronous, see ProfileWriter
+		bool LoadFromDisk(); // reads only index of levels and journal
+		void Flush(); // waits for pending asynchronous writes
+
+		bool IsLevelAvailable(int level) const;
+		int LastAvailableLevel() const;
+
+		// accessors
+		const std::string& path() const { return path_; }
+		size_t levels() const { return level_.size(); }
+		const World* level(size_t i) { return Decode(i); } // nullptr if saved world is damaged
+	private:
+		bool Parse(const std::string& data, std::vector<ProfileWriter::Saved>& saved);
+		bool ParseLegacy(const std::string& data, std::vector<ProfileWriter::Saved>& saved);
+		bool LoadIndex(std::istream& s, std::vector<ProfileWriter::Saved>& saved, bool& migrate);
+		size_t ReplayJournal(std::vector<ProfileWriter::Saved>& saved, bool& damaged);
+		World* Decode(size_t level);
+		void Persist(size_t level);
+	private:
+		std::string path_;
+		std::vector<std::shared_ptr<World>> level_; // nullptr until decoded
+		Ui32 generation_ = 0; // incremented by every rewrite of profile file
+		bool migrate_ = false; // profile file has old format and is rewritten by first save
+		std::unique_ptr<ProfileWriter> writer_; // replaced by loading, files are written only on save
+	};
+
+}
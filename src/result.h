@@ -22,7 +22,7 @@
 
 #pragma once
 
-#include "defs.h"
+#include "types.h"
 
 namespace pilecode {
 
@@ -0,0 +1,146 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "serialize.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace pilecode {
+
+	void BinaryWriter::WriteU16(Ui16 v)
+	{
+		WriteU8(Ui8(v));
+		WriteU8(Ui8(v >> 8));
+	}
+
+	void BinaryWriter::WriteU32(Ui32 v)
+	{
+		WriteU16(Ui16(v));
+		WriteU16(Ui16(v >> 16));
+	}
+
+	void BinaryWriter::WriteU64(Ui64 v)
+	{
+		WriteU32(Ui32(v));
+		WriteU32(Ui32(v >> 32));
+	}
+
+	void BinaryWriter::WriteVar(Ui64 v)
+	{
+		while (v >= 0x80) {
+			WriteU8(Ui8(v | 0x80));
+			v >>= 7;
+		}
+		WriteU8(Ui8(v));
+	}
+
+	void BinaryWriter::PatchU32(size_t offset, Ui32 v)
+	{
+		for (size_t i = 0; i < 4; i++, v >>= 8) {
+			data_[offset + i] = char(Ui8(v));
+		}
+	}
+
+	Ui8 BinaryReader::ReadU8()
+	{
+		if (pos_ == end_) {
+			failed_ = true;
+			return 0;
+		}
+		return Ui8(*pos_++);
+	}
+
+	Ui16 BinaryReader::ReadU16()
+	{
+		Ui16 lo = ReadU8();
+		return Ui16(lo | (Ui16(ReadU8()) << 8));
+	}
+
+	Ui32 BinaryReader::ReadU32()
+	{
+		Ui32 lo = ReadU16();
+		return lo | (Ui32(ReadU16()) << 16);
+	}
+
+	Ui64 BinaryReader::ReadU64()
+	{
+		Ui64 lo = ReadU32();
+		return lo | (Ui64(ReadU32()) << 32);
+	}
+
+	Ui64 BinaryReader::ReadVar()
+	{
+		Ui64 v = 0;
+		for (Ui32 shift = 0; shift < 64; shift += 7) {
+			Ui8 b = ReadU8();
+			v |= Ui64(b & 0x7f) << shift;
+			if (!(b & 0x80)) {
+				return v;
+			}
+		}
+		Fail(); // too long
+		return 0;
+	}
+
+	const char* BinaryReader::ReadBytes(size_t size)
+	{
+		if (left() < size) {
+			Fail();
+			return nullptr;
+		}
+		const char* p = pos_;
+		pos_ += size;
+		return p;
+	}
+
+	std::string ReadAll(std::istream& s)
+	{
+		std::string data;
+		std::streampos begin = s.tellg();
+		if (begin != std::streampos(-1) && s.seekg(0, std::ios::end)) {
+			std::streampos end = s.tellg();
+			s.seekg(begin);
+			data.resize(size_t(end - begin));
+			s.read(&data[0], data.size());
+			data.resize(size_t(s.gcount()));
+		}
+		else {
+			s.clear();
+			data.assign(std::istreambuf_iterator<char>(s), std::istreambuf_iterator<char>());
+		}
+		return data;
+	}
+
+	size_t BytesLeft(std::istream& s, size_t limit)
+	{
+		std::streampos pos = s.tellg();
+		if (pos == std::streampos(-1) || !s.seekg(0, std::ios::end)) {
+			s.clear();
+			return limit;
+		}
+		std::streampos end = s.tellg();
+		s.seekg(pos);
+		return std::min(limit, size_t(end - pos));
+	}
+
+}
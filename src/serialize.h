@@ -0,0 +1,91 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#pragma once
+
+#include "types.h"
+
+#include <iostream>
+#include <string>
+
+namespace pilecode {
+
+	// Appends fixed-width little-endian fields and varints to a memory buffer
+	class BinaryWriter {
+	public:
+		void WriteU8(Ui8 v) { data_.push_back(char(v)); }
+		void WriteU16(Ui16 v);
+		void WriteU32(Ui32 v);
+		void WriteU64(Ui64 v);
+		void WriteVar(Ui64 v); // LEB128
+		void WriteSVar(Si64 v) { WriteVar((Ui64(v) << 1) ^ Ui64(v >> 63)); } // zigzag
+		void WriteBytes(const void* p, size_t size) { data_.append(static_cast<const char*>(p), size); }
+		void PatchU32(size_t offset, Ui32 v); // overwrite field written earlier
+
+		// accessors
+		const std::string& data() const { return data_; }
+		std::string& data() { return data_; }
+		size_t size() const { return data_.size(); }
+	private:
+		std::string data_;
+	};
+
+	// Parses fields written by BinaryWriter from a memory buffer
+	// Reading past the end sets failed() and yields zeros
+	class BinaryReader {
+	public:
+		BinaryReader(const char* begin, const char* end) : pos_(begin), end_(end) {}
+		explicit BinaryReader(const std::string& data) : BinaryReader(data.data(), data.data() + data.size()) {}
+
+		Ui8 ReadU8();
+		Ui16 ReadU16();
+		Ui32 ReadU32();
+		Ui64 ReadU64();
+		Ui64 ReadVar();
+		Si64 ReadSVar() { Ui64 v = ReadVar(); return Si64(v >> 1) ^ -Si64(v & 1); }
+		const char* ReadBytes(size_t size); // returns nullptr if there is not enough data
+		void Fail() { failed_ = true; pos_ = end_; }
+
+		// accessors
+		bool failed() const { return failed_; }
+		size_t left() const { return size_t(end_ - pos_); }
+		const char* pos() const { return pos_; }
+	private:
+		const char* pos_;
+		const char* end_;
+		bool failed_ = false;
+	};
+
+	// Reads the rest of stream into memory with one bulk read
+	std::string ReadAll(std::istream& s);
+
+	// Returns number of bytes left in stream, at most `limit' (also if stream is not seekable)
+	size_t BytesLeft(std::istream& s, size_t limit);
+
+	// Legacy raw POD io, only used to migrate old saves
+	template <class T>
+	void Load(std::istream& is, T& t)
+	{
+		// works fine for PODs if you dont bother about endians
+		is.read(reinterpret_cast<char*>(&t), sizeof(T));
+	}
+}
@@ -52,4 +52,14 @@ namespace pilecode {
 		}
 	}
 
+	void SfxWorldEvents::OnRead(Robot* robot, Vec3Si32 w, Letter letter)
+	{
+		sfx::g_read.Play();
+	}
+
+	void SfxWorldEvents::OnWrite(Robot* robot, Vec3Si32 w, Letter letter)
+	{
+		sfx::g_write.Play();
+	}
+
 }
@@ -23,10 +23,18 @@
 #pragma once
 
 #include "defs.h"
+#include "pilecode.h"
 #include "result.h"
 
 namespace pilecode {
 
 	void SfxResponse(ResultStatus status);
 
+	// Plays sounds for simulation events
+	class SfxWorldEvents : public WorldEvents {
+	public:
+		void OnRead(Robot* robot, Vec3Si32 w, Letter letter) override;
+		void OnWrite(Robot* robot, Vec3Si32 w, Letter letter) override;
+	};
+
 }
@@ -0,0 +1,131 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "timeline.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace pilecode {
+
+	Timeline::Timeline(size_t maxBytes, size_t period)
+		: maxBytes_(maxBytes)
+		, initPeriod_(period)
+		, period_(period)
+	{}
+
+	// Forgets recorded history, `world' becomes the first keyframe
+	void Timeline::Reset(const World& world)
+	{
+		keyframes_.clear();
+		bytes_ = 0;
+		period_ = initPeriod_;
+		first_ = last_ = world.steps();
+		AddKeyframe(world);
+	}
+
+	// Should be called after every simulation step or World::Advance()
+	void Timeline::Record(const World& world)
+	{
+		if (keyframes_.empty() || world.steps() < first_) {
+			return; // not reset or was not recorded from the beginning
+		}
+		// jump clears undo journal, so keyframe after it is the only quick way back to later steps
+		bool jumped = world.steps() > last_ + 1;
+		last_ = std::max(last_, world.steps());
+		if (jumped || world.steps() >= keyframes_.back().step + period_) {
+			AddKeyframe(world);
+			if (bytes_ > maxBytes_) {
+				Thin();
+			}
+		}
+	}
+
+	// Restores state of `world' at given recorded step
+	// Returns false iff step was not recorded (`world' is not changed) or `world' is not the recorded one
+	bool Timeline::Seek(World* world, size_t step) const
+	{
+		if (keyframes_.empty() || step < first_ || step > last_) {
+			return false;
+		}
+		// keyframe before step is used, so that simulated steps after it can be undone
+		auto keyframe = std::lower_bound(keyframes_.begin(), keyframes_.end(), step,
+			[](const Keyframe& k, size_t s) { return k.step < s; });
+		if (keyframe != keyframes_.begin()) {
+			--keyframe;
+		}
+
+		// do not produce side effects while simulating
+		WorldEvents* events = world->events();
+		world->set_events(nullptr);
+
+		// Go through recorded steps if they are closer than keyframe, otherwise restore keyframe
+		// and repeat or simulate steps after it, both keep undo journal of `world'
+		size_t now = world->steps();
+		bool recorded = step <= now ? now - step <= world->undoable() : step - now <= world->redoable();
+		if (recorded && std::max(now, step) - std::min(now, step) <= step - keyframe->step) {
+			for (size_t i = step; i < now; i++) {
+				world->Undo();
+			}
+		}
+		else {
+			BinaryReader s(keyframe->data);
+			if (!world->LoadStep(s)) {
+				world->set_events(events);
+				return false; // recorded from another world
+			}
+		}
+		while (world->steps() < step) {
+			if (!world->Redo()) {
+				world->Simulate();
+			}
+		}
+
+		world->set_events(events);
+		return true;
+	}
+
+	void Timeline::AddKeyframe(const World& world)
+	{
+		BinaryWriter s;
+		world.SaveStep(s);
+		keyframes_.push_back(Keyframe{world.steps(), std::move(s.data())});
+		bytes_ += keyframes_.back().data.size();
+	}
+
+	// Doubles period and drops keyframes that are too close to previous ones
+	void Timeline::Thin()
+	{
+		period_ *= 2;
+		size_t kept = 1;
+		for (size_t i = 1; i < keyframes_.size(); i++) {
+			if (keyframes_[i].step >= keyframes_[kept - 1].step + period_) {
+				std::swap(keyframes_[kept++], keyframes_[i]);
+			}
+			else {
+				bytes_ -= keyframes_[i].data.size();
+			}
+		}
+		keyframes_.resize(kept);
+	}
+
+}
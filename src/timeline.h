@@ -0,0 +1,67 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#pragma once
+
+#include "pilecode.h"
+
+#include <string>
+#include <vector>
+
+namespace pilecode {
+
+	// Keeps world snapshots (keyframes) taken every few steps of simulation
+	// to seek to any simulated step by restoring the nearest keyframe and simulating the rest
+	class Timeline {
+	public:
+		explicit Timeline(size_t maxBytes = 32 * 1024 * 1024, size_t period = 64);
+
+		// recording
+		void Reset(const World& world);
+		void Record(const World& world);
+
+		// seeking
+		bool Seek(World* world, size_t step) const;
+
+		// accessors
+		size_t first() const { return first_; }
+		size_t last() const { return last_; }
+		size_t period() const { return period_; }
+		size_t bytes() const { return bytes_; }
+	private:
+		struct Keyframe {
+			size_t step;
+			std::string data; // serialized with World::SaveStep()
+		};
+		void AddKeyframe(const World& world);
+		void Thin();
+	private:
+		size_t maxBytes_;
+		size_t initPeriod_;
+		size_t period_; // adapts to fit keyframes into maxBytes_
+		size_t bytes_ = 0;
+		size_t first_ = 0;
+		size_t last_ = 0;
+		std::vector<Keyframe> keyframes_; // sorted by step
+	};
+
+}
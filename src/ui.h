@@ -638,6 +638,117 @@ namespace pilecode {
         bool hoverUseMask_ = false;
 	};
 
+	class PSlider {
+	public:
+		explicit PSlider(Region region, Si32 knobWidth = 8)
+			: reg_(region)
+		{
+			track_ = MakeRect(reg_.width(), std::max(2, reg_.height() / 4));
+			knob_ = MakeRect(knobWidth, reg_.height());
+		}
+
+		PSlider* Change(std::function<void(PSlider*)> onChange)
+		{
+			onChange_ = onChange;
+			return this;
+		}
+
+		PSlider* OnUpdate(std::function<void(PSlider*)> onUpdate)
+		{
+			onUpdate_ = onUpdate;
+			return this;
+		}
+
+		bool Control()
+		{
+			Vec2Si32 s = ae::MousePos();
+			hoverNext_ =
+				s.x >= reg_.x1() &&
+				s.y >= reg_.y1() &&
+				s.x <  reg_.x2() &&
+				s.y <  reg_.y2();
+
+			if (enabled_) {
+				if (hoverNext_ && IsKeyOnce(ae::kKeyMouseLeft)) {
+					drag_ = true;
+				}
+				if (drag_ && ae::IsKeyDown(ae::kKeyMouseLeft)) {
+					float value = float(s.x - reg_.x1()) / float(std::max(1, reg_.width()));
+					value = std::min(1.0f, std::max(0.0f, value));
+					if (value != value_) {
+						value_ = value;
+						if (onChange_) {
+							onChange_(this);
+						}
+					}
+				}
+				else {
+					drag_ = false;
+				}
+			}
+			else {
+				drag_ = false;
+			}
+
+			// Continue checks if slider is not hovered or dragged
+			return !enabled_ || (!hoverNext_ && !drag_);
+		}
+
+		void Update()
+		{
+			hover_ = hoverNext_;
+			hoverNext_ = false;
+			if (onUpdate_) {
+				onUpdate_(this);
+			}
+		}
+
+		void Render()
+		{
+			if (enabled_) {
+				auto blend = (hover_ || drag_ ? ui::HoverColor() : color_);
+				AlphaDrawAndBlend(track_, reg_.x1(), reg_.y1() + (reg_.height() - track_.Height()) / 2, blend, 0x80);
+				Si32 x = reg_.x1() + Si32(value_ * float(reg_.width() - knob_.Width()));
+				AlphaDrawAndBlend(knob_, x, reg_.y1(), blend);
+			}
+		}
+
+		// accessors
+		float value() const { return value_; }
+		void set_value(float value) { value_ = value; }
+		bool drag() const { return drag_; }
+		bool enabled() const { return enabled_; }
+		void set_enabled(bool value) { enabled_ = value; }
+		void set_color(Rgba value) { color_ = value; }
+
+	private:
+		static Sprite MakeRect(Si32 width, Si32 height)
+		{
+			Sprite sprite;
+			sprite.Create(width, height);
+			for (Si32 y = 0; y < height; y++) {
+				Rgba* row = sprite.RgbaData() + y * sprite.StridePixels();
+				for (Si32 x = 0; x < width; x++) {
+					row[x] = Rgba(0xff, 0xff, 0xff, 0xff);
+				}
+			}
+			return sprite;
+		}
+
+	private:
+		Region reg_;
+		Sprite track_;
+		Sprite knob_;
+		std::function<void(PSlider*)> onChange_;
+		std::function<void(PSlider*)> onUpdate_;
+		float value_ = 0.0f;
+		bool hover_ = false;
+		bool hoverNext_ = false;
+		bool drag_ = false;
+		bool enabled_ = true;
+		Rgba color_ = Rgba(0, 0, 0, 0);
+	};
+
     inline Sprite MakeBgForModal()
     {
         // Clone backbuffer into bg sprite and do some filters
@@ -0,0 +1,1075 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "viewport.h"
+
+#include "data.h"
+#include "graphics.h"
+#include "ui.h"
+
+#include "engine/arctic_math.h"
+
+namespace pilecode {
+
+	Si32 Pos::dx = 14 * 4;
+	Si32 Pos::dy = 7 * 4;
+	Si32 Pos::dz = 25 * 4;
+
+	bool Shadow::ceiling(Si32 dx, Si32 dy) const
+	{
+		// transform ranges: [-1, 0, 1] ---> [0, 1, 2]
+		dx++;
+		dy++;
+		return (bits_ >> (dy * 3 + dx)) & 1;
+	}
+
+	WorldData::WorldData(size_t colors)
+	{
+		tileSprite_.resize(colors);
+		for (Si32 wz = 0; wz < colors; wz++) {
+			auto& ts = tileSprite_[wz];
+			ts.resize(kTlMax);
+			float alpha = float(wz) / (colors - 1);
+			for (Si32 i = 0; i < kTlMax; i++) {
+				TileType t = TileType(i);
+				Sprite& src = image::g_tile[t];
+				Sprite& dst = ts[i];
+				dst.Create(src.Width(), src.Height());
+				Rgba* srcIt0 = src.RgbaData();
+				Rgba* dstIt0 = dst.RgbaData();
+				for (Si32 y = 0; y < src.Height(); srcIt0 += src.StridePixels(), dstIt0 += dst.StridePixels(), y++) {
+					Rgba* srcIt = srcIt0;
+					Rgba* dstIt = dstIt0;
+					for (Si32 x = 0; x < src.Width(); srcIt++, dstIt++, x++) {
+						*dstIt = *srcIt;
+						Si16 gdelta = Si16(dstIt->g * alpha);
+						Si16 bdelta = Si16(dstIt->b * alpha);
+						dstIt->g += bdelta - gdelta;
+						dstIt->b += gdelta - bdelta;
+					}
+				}
+			}
+		}
+	}
+
+	Sprite* WorldData::TileSprite(Si32 color, TileType type)
+	{
+		color = color % tileSprite_.size();
+		return &tileSprite_[color][type];
+	}
+
+	WorldData& WorldParams::data()
+	{
+		if (!*data_) {
+			data_->reset(new WorldData(colors_));
+		}
+		return **data_;
+	}
+
+	void Tile::Draw(ViewPort* vp, Si32 wx, Si32 wy, Si32 wz, Si32 color, Ui16 ceiling) const
+	{
+		// tile brick
+		if (type() != kTlNone) {
+			Sprite* sprite = vp->world()->params().data().TileSprite(color, type());
+			vp->Draw(sprite, wx, wy, wz, ViewPort::zlStatic, Vec2Si32(0, 0))
+				.Alpha();
+		}
+
+		// output
+		if (output() != kLtSpace) {
+			Sprite* sprite = output() == letter() ?
+				&image::g_letter_output_filled[output()] :
+				&image::g_letter_output[output()];
+			vp->Draw(sprite, wx, wy, wz, ViewPort::zlStatic)
+				.Alpha()
+				.PassEventThrough();
+		}
+
+		// letter
+		if (letter() != kLtSpace) {
+			vp->Draw(&image::g_letter[letter()], wx, wy, wz, ViewPort::zlStatic, Vec2Si32(0, 0))
+				.Alpha()
+				.PassEventThrough();
+		}
+
+		// shadow
+		if (type() != kTlNone) {
+			vp->DrawShadow(Shadow(ceiling), wx, wy, wz, ViewPort::zlStatic);
+		}
+	}
+
+	// Draws tile of platform at world cell `w' (if any)
+	void Platform::Draw(ViewPort* vp, Vec3Si32 w)
+	{
+		Si32 ix = PlatformX(w.x);
+		Si32 iy = PlatformY(w.y);
+		if (w.z != z_ || ix < 0 || ix >= w_ || iy < 0 || iy >= h_) {
+			return;
+		}
+		if (!ceilings_) {
+			IndexCeilings(vp->world());
+		}
+		size_t i = size_t(iy) * w_ + ix;
+		(*tiles_)[i].Draw(vp, w.x, w.y, w.z, index(), (*ceilings_)[i]);
+	}
+
+	void Robot::CalculatePosition(ViewPort* vp, Vec3Si32& w, Vec2Si32& off, Si32& body_off_y) const
+	{
+		Platform* p = vp->world()->platform(platform_);
+		w = p->ToWorld(px_, py_, 0);
+
+		off = Pos::ToScreen(d_pos());
+		off.x = Si32(off.x * vp->progress());
+		off.y = Si32(off.y * vp->progress());
+
+		body_off_y = (Si32)round(4.0 * sin((vp->progress() + (seed_ % 1000) / 1000.0) * 2.0 * M_PI));
+	}
+
+	void Robot::Draw(ViewPort* vp)
+	{
+		Vec3Si32 w;
+		Vec2Si32 off;
+		Si32 body_off_y;
+		CalculatePosition(vp, w, off, body_off_y);
+
+		vp->Draw(&image::g_robotShadow, w, 2, off)
+			.Alpha()
+			.PassEventThrough();
+		vp->Draw(&image::g_robot, w, 2, Vec2Si32(off.x, off.y + body_off_y))
+			.Alpha()
+			.Interactive(0, this);
+
+		if (reg_ != kLtSpace) {
+			vp->Draw(&image::g_letter[reg_], w, 2,
+				Vec2Si32(off.x, off.y + body_off_y + g_yrobotReg))
+				.Alpha()
+				.PassEventThrough();
+		}
+	}
+
+	// Static commands are kept by viewport, so only tiles of its stale cells are drawn
+	void World::Draw(ViewPort* vp)
+	{
+		for (Vec3Si32 w : vp->stale()) {
+			DrawTile(vp, w);
+		}
+		for (Robot& r : robot_) {
+			r.Draw(vp);
+		}
+	}
+
+	void World::DrawTile(ViewPort* vp, Vec3Si32 w)
+	{
+		for (auto& p : platform_) {
+			p->Draw(vp, w);
+		}
+	}
+
+	ViewPort::ViewPort(World* world)
+		: wparams_(world->params())
+		, visible_z_(wparams_.zsize())
+	{
+		Vec2Si32 lo(wparams_.xsize(), wparams_.ysize());
+		Vec2Si32 hi(0, 0);
+		for (Si32 i = 0; i < world->platforms(); i++) {
+			const Platform* p = world->platform(i);
+			if (p->w() > 0 && p->h() > 0) {
+				lo.x = std::min(lo.x, std::max(p->WorldX(0), 0));
+				lo.y = std::min(lo.y, std::max(p->WorldY(0), 0));
+				hi.x = std::max(hi.x, std::min(p->WorldX(p->w()), wparams_.xsize()));
+				hi.y = std::max(hi.y, std::min(p->WorldY(p->h()), wparams_.ysize()));
+			}
+		}
+		if (lo.x < hi.x && lo.y < hi.y) {
+			boxOrigin_ = lo;
+			boxSize_ = Vec2Si32(hi.x - lo.x, hi.y - lo.y);
+		}
+		cmnds_.resize(size_t(boxSize_.x) * boxSize_.y * wparams_.zsize() * zlSize);
+		layers_.resize(wparams_.zsize());
+		dirty_.assign(wparams_.zsize(), Bitboard(boxSize_.x, boxSize_.y));
+		for (Si32 zl = 0; zl < zlSize; zl++) {
+			ResetReach(zl);
+		}
+
+		transparent_.Create(screen::w, screen::h);
+		xmin_ = std::numeric_limits<float>::max();
+		ymin_ = std::numeric_limits<float>::max();
+		xmax_ = std::numeric_limits<float>::min();
+		ymax_ = std::numeric_limits<float>::min();
+		world->ForEachTile([=](Vec3Si32 w, const Tile*) {
+			Pos p(w);
+			if (xmin_ > -p.x) {
+				xmin_ = -(float)p.x;
+			}
+			if (ymin_ > -p.y) {
+				ymin_ = -(float)p.y;
+			}
+			if (xmax_ < -p.x) {
+				xmax_ = -(float)p.x;
+			}
+			if (ymax_ < -p.y) {
+				ymax_ = -(float)p.y;
+			}
+		});
+		
+		//xmin_ = xmax_ = ymin_ = ymax_ = 0;
+
+		// adjustments for the fact that Pos gives coords of the top corner of tile
+		xmin_ -= Pos::dx;
+		xmax_ += Pos::dx;
+		ymin_ -= 2*Pos::dy;
+		ymax_ += Pos::dz;
+
+		// adjustment for screen center
+		xmin_ += screen::cx;
+		xmax_ += screen::cx;
+		ymin_ += screen::cy;
+		ymax_ += screen::cy;
+        
+		// adjustment for tile position
+		xmin_ -= g_xtileorigin;
+		xmax_ -= g_xtileorigin;
+		ymin_ -= g_ytileorigin;
+		ymax_ -= g_ytileorigin;
+
+        // adjustment for screen size
+        float xscreen = (float)screen::w;
+        float yscreen = (float)screen::h;
+        if (xmax_ - xmin_ < xscreen) {
+            xmin_ = xmax_ = (xmin_ + xmax_ ) / 2;
+        } else {
+            xmin_ += xscreen / 2;
+            xmax_ -= xscreen / 2;
+        }
+        if (ymax_ - ymin_ < yscreen) {
+            ymin_ = ymax_ = (ymin_ + ymax_ ) / 2;
+        } else {
+            ymin_ += yscreen / 2;
+            ymax_ -= yscreen / 2;
+        }
+
+		Center();
+	}
+
+	ViewPort::~ViewPort()
+	{
+		set_world(nullptr);
+	}
+
+	void ViewPort::set_world(World* world)
+	{
+		if (world_) {
+			world_->RemoveListener(this);
+		}
+		world_ = world;
+		if (world_) {
+			world_->AddListener(this);
+			OnEdit(*world_);
+		}
+	}
+
+	// Only tiles have static commands, so robots are not tracked
+	void ViewPort::OnChanges(const World&, const std::vector<TileChange>& tiles, const std::vector<RobotChange>&)
+	{
+		for (const TileChange& change : tiles) {
+			MarkDirty(change.w);
+		}
+	}
+
+	void ViewPort::OnEdit(const World&)
+	{
+		InvalidateStatic();
+	}
+
+	// Static commands of cell `w' will be drawn again in the next frame
+	void ViewPort::MarkDirty(Vec3Si32 w)
+	{
+		Si32 x = w.x - boxOrigin_.x;
+		Si32 y = w.y - boxOrigin_.y;
+		if (x >= 0 && x < boxSize_.x && y >= 0 && y < boxSize_.y && w.z >= 0 && w.z < Si32(dirty_.size())) {
+			dirty_[w.z].set(x, y, true);
+		}
+	}
+
+	// All static commands will be drawn again in the next frame and layers rendered from scratch
+	void ViewPort::InvalidateStatic()
+	{
+		for (Bitboard& dirty : dirty_) {
+			for (Si32 y = 0; y < dirty.h(); y++) {
+				for (Si32 x = 0; x < dirty.w(); x++) {
+					dirty.set(x, y, true);
+				}
+			}
+		}
+		for (Layer& layer : layers_) {
+			layer.valid = false;
+			layer.changed.clear();
+		}
+		ResetReach(zlStatic);
+	}
+
+	// Changes of returned command last one frame: changed static command is redrawn
+	// into its layer in this frame and its cell is drawn again in the next one
+	ViewPort::RenderCmnd* ViewPort::GetRenderCmnd(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz)
+	{
+		for (Si32 zl = 0; zl < zlSize; zl++) {
+			RenderList& rlist = renderList(wx, wy, wz, zl);
+			if (&rlist == &discarded_) {
+				return nullptr;
+			}
+			for (RenderCmnd& cmnd : rlist.next) {
+				if (cmnd.sprite_ == sprite) {
+					if (zl == zlStatic) { // layer is rendered after stale cells are committed
+						MarkDirty(Vec3Si32(wx, wy, wz));
+					}
+					return &cmnd;
+				}
+			}
+			if (zl == zlStatic) { // kept command of cell that is not stale
+				for (RenderCmnd& cmnd : rlist.prev) {
+					if (cmnd.sprite_ == sprite) {
+						MarkDirty(Vec3Si32(wx, wy, wz));
+						layers_[wz].changed.push_back(size_t(wy - boxOrigin_.y) * boxSize_.x + (wx - boxOrigin_.x));
+						return &cmnd;
+					}
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	ViewPort::RenderCmnd* ViewPort::GetRenderCmnd(Sprite* sprite, Vec3Si32 w)
+	{
+		return GetRenderCmnd(sprite, w.x, w.y, w.z);
+	}
+
+	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl, Vec2Si32 off)
+	{
+		RenderList& rlist = renderList(wx, wy, wz, zl);
+		Reach(zl, sprite, off);
+		Use(rlist, zl);
+		rlist.next.emplace_back(RenderCmnd(RenderCmnd::kSprite, sprite, off));
+		return rlist.next.back();
+	}
+
+	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl)
+	{
+		return Draw(sprite, wx, wy, wz, zl, Vec2Si32(0, 0));
+	}
+
+	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Vec3Si32 w, Si32 zl, Vec2Si32 off)
+	{
+		return Draw(sprite, w.x, w.y, w.z, zl, off);
+	}
+
+	ViewPort::RenderCmnd& ViewPort::Draw(Sprite* sprite, Vec3Si32 w, Si32 zl)
+	{
+		return Draw(sprite, w, zl, Vec2Si32(0, 0));
+	}
+
+	ViewPort::RenderCmnd& ViewPort::DrawShadow(Shadow shadow, Si32 wx, Si32 wy, Si32 wz, Si32 zl)
+	{
+		RenderList& rlist = renderList(wx, wy, wz, zl);
+		Reach(zl, &image::g_tileMask, Vec2Si32(0, 0)); // shadow masks have the same geometry
+		Use(rlist, zl);
+		rlist.next.emplace_back(RenderCmnd(shadow));
+		return rlist.next.back();
+	}
+
+	void ViewPort::BeginRender(double time)
+	{
+		curFrameTime_ = time;
+		if (lastFrameTime_ == 0.0) {
+			lastFrameTime_ = curFrameTime_ - 1.0;
+		}
+		transparent_.Clear();
+
+		drawn_z_ = std::min(visible_z_ + 1, wparams_.zsize());
+		stale_.clear();
+		offscreen_.clear();
+		for (Si32 wz = 0; wz < drawn_z_; wz++) {
+			dirty_[wz].ForEach([&](Si32 x, Si32 y) {
+				offscreen_.push_back(Vec3Si32(boxOrigin_.x + x, boxOrigin_.y + y, wz));
+			});
+			dirty_[wz].Clear();
+		}
+		CollectStale();
+	}
+
+	// Dynamic render lists are swapped at the end of frame only if they have commands
+	void ViewPort::Use(RenderList& rlist, Si32 zl)
+	{
+		if (zl != zlStatic && rlist.next.empty() && &rlist != &discarded_) {
+			used_.push_back(&rlist);
+		}
+	}
+
+	// Moves dirty cells that are visible with current static reach from `offscreen_' to stale cells
+	void ViewPort::CollectStale()
+	{
+		const Vec2Si32& lo = reachLo_[zlStatic];
+		const Vec2Si32& hi = reachHi_[zlStatic];
+		bool all = lo.x >= hi.x || lo.y >= hi.y; // nothing is kept, so reach is unknown
+		Sprite bb = ae::GetEngine()->GetBackbuffer();
+		size_t n = 0;
+		for (Vec3Si32 w : offscreen_) {
+			Pos p0 = GetPos(w.x, w.y, w.z);
+			if (all || (p0.x + hi.x > 0 && p0.x + lo.x < bb.Width()
+				&& p0.y + hi.y > 0 && p0.y + lo.y < bb.Height())) {
+				stale_.push_back(w);
+			}
+			else {
+				offscreen_[n++] = w;
+			}
+		}
+		offscreen_.resize(n);
+		staleLo_ = lo;
+		staleHi_ = hi;
+	}
+
+	void ViewPort::ApplyCommands()
+	{
+		discarded_.next.clear();
+		if (cmnds_.empty()) {
+			return;
+		}
+		size_t cells = size_t(boxSize_.x) * boxSize_.y;
+
+		// static reach may grow with commands of stale cells, then dirty cells it makes visible are drawn too
+		while (world_ && (staleLo_ != reachLo_[zlStatic] || staleHi_ != reachHi_[zlStatic])) {
+			size_t first = stale_.size();
+			CollectStale();
+			for (size_t i = first; i < stale_.size(); i++) {
+				world_->DrawTile(this, stale_[i]);
+			}
+		}
+
+		// the others stay dirty until they are scrolled into view
+		for (Vec3Si32 w : offscreen_) {
+			MarkDirty(w);
+		}
+		offscreen_.clear();
+
+		// static commands of stale cells replace kept ones, which are drawn from `prev' lists
+		for (Vec3Si32 w : stale_) {
+			renderList(w.x, w.y, w.z, zlStatic).EndRender();
+			Layer& layer = layers_[w.z];
+			if (layer.valid) {
+				layer.changed.push_back(size_t(w.y - boxOrigin_.y) * boxSize_.x + (w.x - boxOrigin_.x));
+				if (layer.changed.size() > cells / 4) { // cheaper to render layer from scratch
+					layer.valid = false;
+					layer.changed.clear();
+				}
+			}
+		}
+
+		RenderList* rlist = &cmnds_[0];
+		for (Pos p2 = GetPos(boxOrigin_.x, boxOrigin_.y); p2.wz < drawn_z_; p2.Ceil()) {
+			RenderCmnd::Filter filter = p2.wz < visible_z_ ? RenderCmnd::kFilterNone : RenderCmnd::kFilterTransparent;
+			for (Si32 zl = 0; zl < zlSize; zl++) {
+				if (zl == zlStatic && filter == RenderCmnd::kFilterNone) {
+					DrawLayer(p2, rlist);
+				}
+				else {
+					bool kept = zl == zlStatic;
+					ForEachVisibleCell(p2, zl, [=](const Pos& p0, size_t i) {
+						for (RenderCmnd& cmnd : kept ? rlist[i].prev : rlist[i].next) {
+							cmnd.Apply(this, p0.x, p0.y, filter);
+						}
+					});
+				}
+				rlist += cells;
+			}
+		}
+
+		// only lists used in this or last frame have commands (including hidden z-levels)
+		for (RenderList* used : lastUsed_) {
+			used->prev.clear();
+		}
+		for (RenderList* used : used_) {
+			std::swap(used->next, used->prev);
+		}
+		std::swap(used_, lastUsed_);
+		used_.clear();
+		for (Si32 zl = 0; zl < zlSize; zl++) {
+			if (zl != zlStatic) {
+				ResetReach(zl);
+			}
+		}
+	}
+
+	static Si32 FloorDiv(Si32 a, Si32 b)
+	{
+		return a / b - ((a % b != 0) && ((a < 0) != (b < 0)) ? 1 : 0);
+	}
+
+	static Si32 CeilDiv(Si32 a, Si32 b)
+	{
+		return -FloorDiv(-a, b);
+	}
+
+	// Extends rectangle covered by commands of z-sublevel `zl' with `sprite' drawn at offset `off'
+	void ViewPort::Reach(Si32 zl, Sprite* sprite, Vec2Si32 off)
+	{
+		Vec2Si32& lo = reachLo_[zl];
+		Vec2Si32& hi = reachHi_[zl];
+		lo.x = std::min(lo.x, off.x - sprite->Pivot().x);
+		lo.y = std::min(lo.y, off.y - sprite->Pivot().y);
+		hi.x = std::max(hi.x, off.x - sprite->Pivot().x + sprite->Width());
+		hi.y = std::max(hi.y, off.y - sprite->Pivot().y + sprite->Height());
+	}
+
+	void ViewPort::ResetReach(Si32 zl)
+	{
+		reachLo_[zl] = Vec2Si32(std::numeric_limits<Si32>::max(), std::numeric_limits<Si32>::max());
+		reachHi_[zl] = Vec2Si32(std::numeric_limits<Si32>::min(), std::numeric_limits<Si32>::min());
+	}
+
+	// Computes range [kb, ke) of cells in a row of `n' cells of z-sublevel `zl' visible within
+	// screen rectangle [clipLo, clipHi), where row starts at screen position `s'
+	// and k-th cell is at `s - k * (Pos::dx, Pos::dy)'
+	void ViewPort::VisibleCells(Si32 zl, Vec2Si32 s, Si32 n, Si32& kb, Si32& ke,
+		Vec2Si32 clipLo, Vec2Si32 clipHi) const
+	{
+		kb = 0;
+		ke = n;
+		if (Pos::dx <= 0 || Pos::dy <= 0) {
+			return;
+		}
+		const Vec2Si32& lo = reachLo_[zl];
+		const Vec2Si32& hi = reachHi_[zl];
+
+		// cell is visible iff `clipLo.x < s.x - k*dx + hi.x' and `s.x - k*dx + lo.x < clipHi.x' (the same for y)
+		kb = std::max(kb, FloorDiv(s.x + lo.x - clipHi.x, Pos::dx) + 1);
+		kb = std::max(kb, FloorDiv(s.y + lo.y - clipHi.y, Pos::dy) + 1);
+		ke = std::min(ke, CeilDiv(s.x + hi.x - clipLo.x, Pos::dx));
+		ke = std::min(ke, CeilDiv(s.y + hi.y - clipLo.y, Pos::dy));
+	}
+
+	// Calls `f(p0, i)' for every cell of z-level `p2.wz' that commands of z-sublevel `zl' may draw on screen,
+	// where `p0' is cell position and `i' is index of cell in render lists of z-level
+	// Invisible z-levels and rows are skipped as a whole, so cost is proportional to visible area
+	template <class F>
+	void ViewPort::ForEachVisibleCell(Pos p2, Si32 zl, F f)
+	{
+		Sprite bb = ae::GetEngine()->GetBackbuffer();
+		ForEachVisibleCell(p2, zl, Vec2Si32(0, 0), Vec2Si32(bb.Width(), bb.Height()), f);
+	}
+
+	// The same for cells that may draw within screen rectangle [clipLo, clipHi)
+	template <class F>
+	void ViewPort::ForEachVisibleCell(Pos p2, Si32 zl, Vec2Si32 clipLo, Vec2Si32 clipHi, F f)
+	{
+		const Vec2Si32& lo = reachLo_[zl];
+		const Vec2Si32& hi = reachHi_[zl];
+		if (lo.x >= hi.x || lo.y >= hi.y) {
+			return; // nothing to draw
+		}
+
+		// z-level is visible iff bounding rectangle of its cells is visible
+		Si32 nx = boxSize_.x;
+		Si32 ny = boxSize_.y;
+		if (Pos::dx > 0 && Pos::dy > 0) {
+			if (p2.x + Pos::dx * (ny - 1) + hi.x <= clipLo.x
+				|| p2.x - Pos::dx * (nx - 1) + lo.x >= clipHi.x
+				|| p2.y + hi.y <= clipLo.y
+				|| p2.y - Pos::dy * (nx + ny - 2) + lo.y >= clipHi.y) {
+				return;
+			}
+		}
+
+		size_t i = 0;
+		for (Pos p1 = p2; p1.wy < boxOrigin_.y + ny; p1.Up(), i += nx) {
+			Si32 kb;
+			Si32 ke;
+			VisibleCells(zl, p1.Screen(), nx, kb, ke, clipLo, clipHi);
+			if (kb >= ke) {
+				continue;
+			}
+			Pos p0 = p1;
+			p0.wx += kb;
+			p0.x -= Pos::dx * kb;
+			p0.y -= Pos::dy * kb;
+			for (Si32 k = kb; k < ke; k++, p0.Right()) {
+				f(p0, i + k);
+			}
+		}
+	}
+
+	// Draws static commands of z-level `p2.wz' kept in render lists starting from `rlist'
+	// Layer is rendered from scratch only if tiles of z-level were edited, screen offset or projection
+	// have changed, otherwise only rectangles of changed cells are rendered again
+	void ViewPort::DrawLayer(Pos p2, RenderList* rlist)
+	{
+		Layer& layer = layers_[p2.wz];
+		Sprite bb = ae::GetEngine()->GetBackbuffer();
+		Vec3Si32 proj(Pos::dx, Pos::dy, Pos::dz);
+		Vec2Si32 screen(bb.Width(), bb.Height());
+
+		// renders commands within screen rectangle [lo, hi) over layer
+		auto render = [&](Vec2Si32 lo, Vec2Si32 hi) {
+			bool blank = layer.lo.x >= layer.hi.x || layer.lo.y >= layer.hi.y;
+			ForEachVisibleCell(p2, zlStatic, lo, hi, [&](const Pos& p0, size_t i) {
+				for (RenderCmnd& cmnd : rlist[i].prev) {
+					if (blank) { // sprite is not needed for empty z-level
+						if (layer.sprite.Width() != screen.x || layer.sprite.Height() != screen.y) {
+							layer.sprite.Create(screen.x, screen.y);
+						}
+						layer.sprite.Clear();
+						blank = false;
+					}
+					cmnd.Apply(this, p0.x, p0.y, layer, lo, hi);
+				}
+			});
+		};
+
+		// set of visible cells depends only on these, so it is the same as in rendered layer
+		bool valid = layer.valid
+			&& layer.origin == p2.Screen()
+			&& layer.proj == proj
+			&& layer.screen == screen
+			&& layer.reachLo == reachLo_[zlStatic]
+			&& layer.reachHi == reachHi_[zlStatic];
+
+		if (!valid) {
+			layer.lo = screen;
+			layer.hi = Vec2Si32(0, 0);
+			render(Vec2Si32(0, 0), screen);
+			layer.valid = true;
+			layer.origin = p2.Screen();
+			layer.proj = proj;
+			layer.screen = screen;
+			layer.reachLo = reachLo_[zlStatic];
+			layer.reachHi = reachHi_[zlStatic];
+		}
+		else {
+			// commands of other cells overlapping rectangle of changed cell are drawn clipped by it
+			for (size_t i : layer.changed) {
+				Pos p0 = GetPos(boxOrigin_.x + Si32(i % boxSize_.x), boxOrigin_.y + Si32(i / boxSize_.x), p2.wz);
+				Vec2Si32 lo(std::max(p0.x + layer.reachLo.x, 0), std::max(p0.y + layer.reachLo.y, 0));
+				Vec2Si32 hi(std::min(p0.x + layer.reachHi.x, screen.x), std::min(p0.y + layer.reachHi.y, screen.y));
+				if (lo.x >= hi.x || lo.y >= hi.y) {
+					continue;
+				}
+				if (layer.lo.x < layer.hi.x && layer.lo.y < layer.hi.y) {
+					LayerClear(layer.sprite, lo.x, lo.y, hi.x - lo.x, hi.y - lo.y);
+				}
+				render(lo, hi);
+			}
+		}
+		layer.changed.clear();
+
+		if (layer.lo.x < layer.hi.x && layer.lo.y < layer.hi.y) {
+			LayerComposite(layer.sprite, layer.lo.x, layer.lo.y,
+				layer.hi.x - layer.lo.x, layer.hi.y - layer.lo.y, bb);
+		}
+	}
+
+	void ViewPort::DrawCeiling(Vec3Si32 w)
+	{
+		// TODO: start/finish animation???
+		Si32 xRadius = Pos::dx;
+		Si32 yRadius = Pos::dy;
+		Si32 aspect = Pos::dx / Pos::dy;
+		Si32 aspectSq = aspect*aspect;
+
+		Si32 rsqMax = xRadius*xRadius + yRadius*yRadius*aspectSq;
+		Sprite bb = ae::GetEngine()->GetBackbuffer();
+		
+		Pos pos = GetPos(w.x, w.y, w.z);
+		Si32 cx = pos.x + g_tileCenter.x;
+		Si32 cy = pos.y + g_tileCenter.y + Pos::dz;
+
+		Si32 x1 = cx - 2 * xRadius;
+		Si32 x2 = cx + 2 * xRadius + 1;
+		Si32 y1 = cy - 2 * yRadius;
+		Si32 y2 = cy + 2 * yRadius + 1;
+
+		x1 = (x1 < 0 ? 0 : x1);
+		x2 = (x2 > bb.Width() ? bb.Width() : x2);
+		y1 = (y1 < 0 ? 0 : y1);
+		y2 = (y2 > bb.Height() ? bb.Height() : y2);
+
+		Si32 offs = y1 * bb.Width() + x1;
+		Rgba* bg = bb.RgbaData() + offs;
+		Rgba* fg = transparent_.RgbaData() + offs;
+
+		for (Si32 y = y1; y < y2; y++) {
+			Ui64 ysq = (y - cy)*(y - cy)*aspectSq;
+			Rgba* bg0 = bg;
+			Rgba* fg0 = fg;
+			for (Si32 x = x1; x < x2; x++) {
+				Ui64 rsq = (x - cx)*(x - cx) + ysq;
+				Ui32 alpha = Ui32(arctic::Clamp(float(rsq) / rsqMax, 0.0f, 1.0f) * 256.0f + 0.5f);
+				if (fg->a > 0) {
+                    Ui32 k = std::min(256 - alpha, (Ui32)fg->a);
+					*bg = RgbaSum(
+						RgbaMult(*fg, k),
+						RgbaMult(*bg, 256 - k)
+					);
+				}
+				fg++;
+				bg++;
+			}
+			bg = bg0 + bb.Width();
+			fg = fg0 + bb.Width();
+		}
+		//DrawWithFixedAlphaBlend(transparent_, 0, 0, 128);
+	}
+
+	void ViewPort::EndRender(bool drawCeiling, Vec3Si32 w)
+	{
+		ApplyCommands();
+		if (drawCeiling) {
+			DrawCeiling(w);
+		}
+		lastFrameTime_ = curFrameTime_;
+	}
+
+	void ViewPort::Event(Vec2Si32 s, std::function<void(EventHandling& eh, Ui64 tag, void* data)> handler)
+	{
+		EventHandling eh(this);
+		Si32 zsize = drawn_z_ - 1; // do not pass events to transparent ceiling z-level
+		if (cmnds_.empty() || zsize <= 0) {
+			return;
+		}
+		Pos p2 = GetPos(boxOrigin_.x + boxSize_.x - 1, boxOrigin_.y + boxSize_.y - 1, zsize - 1);
+		RenderList* rlist = &renderList(p2.wx, p2.wy, p2.wz, zlSize - 1);
+		for (; p2.wz >= 0; p2.Floor()) {
+			for (eh.zl_ = zlSize - 1; eh.zl_ >= 0; eh.zl_--) {
+				for (Pos p1 = p2; p1.wy >= boxOrigin_.y; p1.Down()) {
+					for (eh.p_ = p1; eh.p_.wx >= boxOrigin_.x; eh.p_.Left()) {
+						for (auto i = rlist->prev.rbegin(), e = rlist->prev.rend(); i != e; ++i) {
+							RenderCmnd& cmnd = *i;
+							if (cmnd.passing_ == kPass) {
+								continue;
+							}
+							if (cmnd.IsHit(s, eh)) {
+								if (cmnd.passing_ == kBlock) {
+									return;
+								}
+								else { // kInteract
+									handler(eh, cmnd.tag_, cmnd.data_);
+									if (!eh.propagate_) {
+										return;
+									}
+								}
+							}
+						}
+						rlist--;
+					}
+				}
+			}
+		}
+	}
+
+	void ViewPort::Move(Vec2F delta)
+	{
+		x_ = ae::Clamp(x_ + delta.x, xmin_, xmax_);
+		y_ = ae::Clamp(y_ + delta.y, ymin_, ymax_);
+	}
+
+	void ViewPort::MoveNoClamp(Vec2F delta)
+	{
+		x_ += delta.x;
+		y_ += delta.y;
+	}
+
+	void ViewPort::Locate(Vec2F loc)
+	{
+		x_ = loc.x;
+		y_ = loc.y;
+	}
+
+	void ViewPort::Center()
+	{
+		Locate(Vec2F((xmin_ + xmax_) / 2, (ymin_ + ymax_) / 2));
+	}
+
+	void ViewPort::IncVisibleZ()
+	{
+		if (visible_z_ < wparams_.zsize()) {
+			visible_z_++;
+		}
+	}
+
+	void ViewPort::DecVisibleZ()
+	{
+		if (visible_z_ > 1) {
+			visible_z_--;
+		}
+	}
+
+    void ViewPort::SetVisibleZ(Si32 z)
+    {
+        visible_z_ = ae::Clamp(z, 1, wparams_.zsize() + 1);
+    }
+    
+	// Converts screen coords `p' into world coords at given z-level `wz'
+	Vec3Si32 ViewPort::ToWorldAtZ(Si32 wz, Vec2Si32 p) const
+	{
+		p.x -= Si32(x_ + 0.5f);
+		p.y -= Si32(y_ + 0.5f);
+		p.x -= g_xtileorigin;
+		p.y -= g_ytileorigin;
+		return Pos::ToWorld(p, wz);
+	}
+
+	// Converts screen coords `p' into world coords and tile coords `tp' at given z-level `wz'
+	Vec3Si32 ViewPort::ToWorldTileAtZ(Si32 wz, Vec2Si32 p, Vec2F& tp) const
+	{
+		p.x -= Si32(x_ + 0.5f);
+		p.y -= Si32(y_ + 0.5f);
+		p.x -= g_xtileorigin;
+		p.y -= g_ytileorigin;
+		Vec3Si32 result = Pos::ToWorld(p, wz);
+		p -= Pos::ToScreen(result);
+		tp = Pos::ToTile(p);
+		return result;
+	}
+
+	// Search all z-levels for highest with real tile
+	// and converts screen coords `p' into world coords `w' of that tile
+	// Returns false iff real tile was not found (`w' is not changed)
+	bool ViewPort::ToWorld(Vec2Si32 p, Vec3Si32& w) const
+	{
+		for (Si32 wz = visible_z_ - 1; wz >= 0; wz--) {
+			Vec3Si32 w0 = ToWorldAtZ(wz, p);
+			if (world_->At(w0)) {
+				w = w0;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Search all z-levels for highest with real tile
+	// and converts screen coords `p' into world coords `w' and tile coords `tp' of that tile
+	// Returns false iff real tile was not found (`w' and `tp' are not changed)
+	bool ViewPort::ToWorldTile(Vec2Si32 p, Vec3Si32& w, Vec2F& tp) const
+	{
+		for (Si32 wz = visible_z_ - 1; wz >= 0; wz--) {
+			Vec2F tp0;
+			Vec3Si32 w0 = ToWorldTileAtZ(wz, p, tp0);
+			if (world_->At(w0)) {
+				tp = tp0;
+				w = w0;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Pos ViewPort::GetPos(Si32 wx, Si32 wy, Si32 wz)
+	{
+		Pos p(wx, wy, wz);
+		p.x += Si32(x_ + 0.5f);
+		p.y += Si32(y_ + 0.5f);
+		return p;
+	}
+
+	static Sprite BuildShadowMask(Sprite& surfaceMask, const Shadow& shadow)
+	{
+		if (shadow.ceiling(0, 0)) {
+			Sprite shadowMask;
+			shadowMask.Create(surfaceMask.Width(), surfaceMask.Height());
+			Rgba* shad = shadowMask.RgbaData();
+			Rgba* surf = surfaceMask.RgbaData();
+			for (Si32 y = 0; y < shadowMask.Height(); y++) {
+				for (Si32 x = 0; x < shadowMask.Width(); x++, shad++, surf++) {
+					if (surf->a > 0) {
+						Si32 tx = x - g_xtileorigin;
+						Si32 ty = y - g_ytileorigin;
+						Vec2F tr = Pos::ToTile(Vec2Si32(tx, ty));
+						
+						float light = 0.0f;
+						float contrast = 6.0f;
+						if (!shadow.ceiling(1, 0)) {
+							light = std::max(light, 1.0f - (1.0f - tr.x) * contrast);
+						}
+						if (!shadow.ceiling(0, 1)) {
+							light = std::max(light, 1.0f - (1.0f - tr.y) * contrast);
+						}
+						if (!shadow.ceiling(-1, 0)) {
+							light = std::max(light, 1.0f - (tr.x) * contrast);
+						}
+						if (!shadow.ceiling(0, -1)) {
+							light = std::max(light, 1.0f - (tr.y) * contrast);
+						}
+
+						if (!shadow.ceiling(1, 1)) {
+							light = std::max(light, 1.0f - (2.0f - tr.x - tr.y) * contrast);
+						}
+						if (!shadow.ceiling(1, -1)) {
+							light = std::max(light, 1.0f - (1.0f - tr.x + tr.y) * contrast);
+						}
+						if (!shadow.ceiling(-1, 1)) {
+							light = std::max(light, 1.0f - (1.0f - tr.y + tr.x) * contrast);
+						}
+						if (!shadow.ceiling(-1, -1)) {
+							light = std::max(light, 1.0f - (tr.x + tr.y) * contrast);
+						}
+						shad->a = (Ui8)std::max(0.0f, std::min(255.0f, float(surf->a) * (1.0f - light) / 8.0f));
+					}
+				}
+			}
+			return shadowMask;
+		}
+		else {
+			return image::g_empty;
+		}
+	}
+
+	// Mask depends only on ceiling bits and projection, so it is built once and reused
+	// while projection stays the same (it changes every frame of zoom transitions)
+	Sprite ViewPort::ShadowMask(Sprite& surfaceMask, const Shadow& shadow)
+	{
+		if (!shadow.ceiling(0, 0)) {
+			return image::g_empty;
+		}
+
+		if (shadowSurface_ != surfaceMask.RgbaData() || shadowProj_ != Vec2Si32(Pos::dx, Pos::dy)) {
+			shadowSurface_ = surfaceMask.RgbaData();
+			shadowProj_ = Vec2Si32(Pos::dx, Pos::dy);
+			shadowMasks_.assign(1 << 9, Sprite()); // for all ceiling configurations
+		}
+		Sprite& mask = shadowMasks_[shadow.bits()];
+		if (mask.Width() == 0) {
+			mask = BuildShadowMask(surfaceMask, shadow);
+		}
+		return mask;
+	}
+
+	ViewPort::RenderCmnd::RenderCmnd(ViewPort::RenderCmnd::Type type,
+		Sprite* sprite, Vec2Si32 off)
+		: type_(type)
+		, sprite_(sprite)
+		, off_(off)
+	{}
+
+	ViewPort::RenderCmnd::RenderCmnd(Shadow shadow)
+		: type_(kShadow)
+		, shadow_(shadow)
+		, passing_(kPass) // shadow shouldn't block events (which is default)
+	{}
+
+	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Blend(Rgba rgba)
+	{
+		blend_ = rgba;
+		return *this;
+	}
+
+	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Alpha()
+	{
+		type_ = kSpriteRgba;
+		return *this;
+	}
+
+	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Opacity(Ui8 value)
+	{
+		opacity_ = value;
+		return *this;
+	}
+
+	ViewPort::RenderCmnd& ViewPort::RenderCmnd::Interactive(Ui64 tag, void* data)
+	{
+		passing_ = kInteract;
+		tag_ = tag;
+		data_ = data;
+		return *this;
+	}
+
+	ViewPort::RenderCmnd& ViewPort::RenderCmnd::PassEventThrough()
+	{
+		passing_ = kPass;
+		return *this;
+	}
+
+	void ViewPort::RenderCmnd::Apply(ViewPort* vp, Si32 x, Si32 y, ViewPort::RenderCmnd::Filter filter)
+	{
+		Sprite to_sprite = filter == kFilterTransparent? vp->transparent(): ae::GetEngine()->GetBackbuffer();
+		x += off_.x;
+		y += off_.y;
+		switch (type_) {
+		case kSprite:
+			if (blend_.a == 0) {
+                sprite_->Draw(x, y, sprite_->Width(), sprite_->Height(),
+                              0, 0, sprite_->Width(), sprite_->Height(), to_sprite);
+            }
+			else {
+				DrawAndBlend(*sprite_, x, y, to_sprite, blend_);
+			}
+			break;
+		case kSpriteRgba:
+			if (blend_.a == 0) {
+				AlphaDraw(*sprite_, x, y, to_sprite, opacity_);
+			}
+			else {
+				AlphaDrawAndBlend(*sprite_, x, y, to_sprite, blend_, opacity_);
+			}
+			break;
+		case kShadow:
+			AlphaDrawAndBlend(vp->ShadowMask(image::g_tileMask, shadow_), x, y, to_sprite, Rgba(0, 0, 0, 255), opacity_);
+			break;
+		}
+	}
+
+	// Draws command within rectangle [lo, hi) of `layer' and extends its drawn rectangle
+	void ViewPort::RenderCmnd::Apply(ViewPort* vp, Si32 x, Si32 y, Layer& layer, Vec2Si32 lo, Vec2Si32 hi)
+	{
+		x += off_.x;
+		y += off_.y;
+		Sprite sprite;
+		switch (type_) {
+		case kSprite: // blended by alpha as well, layer has no opaque pixels
+		case kSpriteRgba:
+			sprite = *sprite_;
+			LayerDraw(sprite, x, y, layer.sprite, lo, hi, blend_, opacity_);
+			break;
+		case kShadow:
+			sprite = vp->ShadowMask(image::g_tileMask, shadow_);
+			LayerDraw(sprite, x, y, layer.sprite, lo, hi, Rgba(0, 0, 0, 255), opacity_);
+			break;
+		}
+
+		Vec2Si32 dlo(std::max(x - sprite.Pivot().x, lo.x), std::max(y - sprite.Pivot().y, lo.y));
+		Vec2Si32 dhi(std::min(x - sprite.Pivot().x + sprite.Width(), hi.x),
+			std::min(y - sprite.Pivot().y + sprite.Height(), hi.y));
+		if (dlo.x < dhi.x && dlo.y < dhi.y) {
+			layer.lo.x = std::min(layer.lo.x, dlo.x);
+			layer.lo.y = std::min(layer.lo.y, dlo.y);
+			layer.hi.x = std::max(layer.hi.x, dhi.x);
+			layer.hi.y = std::max(layer.hi.y, dhi.y);
+		}
+	}
+
+	bool ViewPort::RenderCmnd::IsHit(Vec2Si32 s, const EventHandling& eh, Ui8 alphaThreshold)
+	{
+		// Calculate sprite coordinates
+		Vec2Si32 r = s - eh.p().Screen() + sprite_->Pivot();
+		Rgba* to = sprite_->RgbaData()
+			+ r.y * sprite_->StridePixels()
+			+ r.x;
+		return to->a > alphaThreshold;
+	}
+}
@@ -0,0 +1,391 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#pragma once
+
+#include "defs.h"
+#include "pilecode.h"
+
+#include "engine/easy.h"
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace pilecode {
+
+	class Shadow {
+	public:
+		explicit Shadow(Ui16 bits = 0) : bits_(bits) {}
+		bool ceiling(Si32 dx, Si32 dy) const;
+		Ui16 bits() const { return bits_; }
+	private:
+		Ui16 bits_; // 3x3 ceiling bitmask (0=sky; 1=ceiling), see World::Ceiling()
+	};
+
+	class WorldData {
+	public:
+		explicit WorldData(size_t colors);
+		Sprite* TileSprite(Si32 color, TileType type);
+	private:
+		std::vector<std::vector<Sprite>> tileSprite_; // tile_[color][tileType]
+	};
+
+	struct Pos {
+		// world to screen representation parameters
+		static Si32 dx;
+		static Si32 dy;
+		static Si32 dz;
+
+		// screen coordinates
+		Si32 x;
+		Si32 y;
+
+		// world coordinates
+		Si32 wx;
+		Si32 wy;
+		Si32 wz;
+
+		Pos(Si32 _wx, Si32 _wy, Si32 _wz)
+			: x(dx * (_wy - _wx))
+			, y(-dy * (_wx + _wy) + dz *_wz)
+			, wx(_wx), wy(_wy), wz(_wz)
+		{}
+
+		explicit Pos(Vec2Si32 w)
+			: Pos(w.x, w.y, 0)
+		{}
+
+		explicit Pos(Vec3Si32 w)
+			: Pos(w.x, w.y, w.z)
+		{}
+
+		void Up()
+		{
+			wy++;
+			x += dx;
+			y -= dy;
+		}
+
+		void Down()
+		{
+			wy--;
+			x -= dx;
+			y += dy;
+		}
+
+		void Right()
+		{
+			wx++;
+			x -= dx;
+			y -= dy;
+		}
+
+		void Left()
+		{
+			wx--;
+			x += dx;
+			y += dy;
+		}
+
+		void Ceil()
+		{
+			wz++;
+			y += dz;
+		}
+
+		void Floor()
+		{
+			wz--;
+			y -= dz;
+		}
+
+		Vec3Si32 World() const
+		{
+			return Vec3Si32(wx, wy, wz);
+		}
+
+		Vec2Si32 Screen() const
+		{
+			return Vec2Si32(x, y);
+		}
+
+		static Vec2Si32 ToScreen(Vec2Si32 w)
+		{
+			return Pos(w).Screen();
+		}
+
+		static Vec2Si32 ToScreen(Vec3Si32 w)
+		{
+			return Pos(w).Screen();
+		}
+
+		static Vec3Si32 ToWorld(Vec2Si32 s, Si32 wz)
+		{
+			s.y -= dz * wz;
+			Si32 wx = Si32(-(float(s.x) / dx + float(s.y) / dy) / 2.0f);
+			Si32 wy = Si32( (float(s.x) / dx - float(s.y) / dy) / 2.0f);
+
+			return Vec3Si32(wx, wy, wz);
+		}
+
+		static Vec2F ToTile(Vec2Si32 s)
+		{
+			float wx = -(float(s.x) / dx + float(s.y) / dy) / 2.0f;
+			float wy =  (float(s.x) / dx - float(s.y) / dy) / 2.0f;
+
+			return Vec2F(wx, wy);
+		}
+	};
+
+	// Draws world and keeps pre-rendered static content in sync with its changes
+	class ViewPort : public WorldListener {
+	public:
+		struct RenderCmnd;
+		friend struct RenderCmnd;
+		struct RenderList;
+		struct Layer;
+		class EventHandling;
+
+	public:
+		enum EventPassing {
+			kBlock = 0, // blocks further event passing (e.g. tile brick)
+			kPass = 1, // pass event further (e.g. shadow)
+			kInteract = 2, // calls event handler (e.g. robot)
+		};
+
+		struct RenderCmnd {
+			enum Type {
+				kSprite = 0,
+				kSpriteRgba = 1,
+				kShadow = 2,
+			};
+
+			enum Filter {
+				kFilterNone = 0,
+				kFilterTransparent,
+			};
+
+			Type type_;
+
+			// for kSprite and kSpriteRgba
+			Sprite* sprite_ = nullptr;
+			Vec2Si32 off_ = Vec2Si32(0, 0);
+			Rgba blend_ = Rgba(Ui32(0));
+			Ui8 opacity_ = 0xff;
+
+			// for kShadow
+			Shadow shadow_;
+
+			// for event handling
+			EventPassing passing_ = kBlock;
+			Ui64 tag_ = 0;
+			void* data_ = nullptr;
+		public:
+			RenderCmnd(Type type, Sprite* sprite, Vec2Si32 off_);
+			explicit RenderCmnd(Shadow shadow);
+
+			RenderCmnd& Blend(Rgba rgba);
+			RenderCmnd& Alpha();
+			RenderCmnd& Opacity(Ui8 value);
+			RenderCmnd& Interactive(Ui64 tag = 0, void* data = nullptr);
+			RenderCmnd& PassEventThrough();
+		private:
+			void Apply(ViewPort* vp, Si32 x, Si32 y, Filter filter);
+			void Apply(ViewPort* vp, Si32 x, Si32 y, Layer& layer, Vec2Si32 lo, Vec2Si32 hi);
+			bool IsHit(Vec2Si32 s, const EventHandling& eh, Ui8 alphaThreshold = 0x80);
+			friend class ViewPort;
+		};
+
+		struct RenderList {
+			std::vector<RenderCmnd> next;
+			std::vector<RenderCmnd> prev;
+
+			void EndRender()
+			{
+				prev.clear();
+				std::swap(next, prev);
+			}
+		};
+
+		// Pre-rendered static content of z-level (see DrawLayer)
+		struct Layer {
+			Sprite sprite; // premultiplied alpha
+			Vec2Si32 lo = Vec2Si32(0, 0); // drawn rectangle of `sprite'
+			Vec2Si32 hi = Vec2Si32(0, 0);
+			std::vector<size_t> changed; // cells with static commands changed since layer was rendered
+
+			// layer is valid while all of these are the same
+			bool valid = false;
+			Vec2Si32 origin = Vec2Si32(0, 0); // screen position of bounding box origin
+			Vec3Si32 proj = Vec3Si32(0, 0, 0); // Pos::dx, Pos::dy and Pos::dz
+			Vec2Si32 screen = Vec2Si32(0, 0);
+			Vec2Si32 reachLo = Vec2Si32(0, 0); // see ViewPort::reachLo_
+			Vec2Si32 reachHi = Vec2Si32(0, 0);
+		};
+
+		class EventHandling {
+		public:
+			explicit EventHandling(ViewPort* vp)
+				: vp_(vp)
+				, p_(0, 0, 0)
+			{}
+			void StopPropagate() { propagate_ = false; }
+			ViewPort* vp() const { return vp_; }
+			Pos p() const { return p_; }
+			Si32 zl() const { return zl_; }
+		private:
+			ViewPort* vp_;
+			Pos p_;
+			Si32 zl_;
+			bool propagate_ = true;
+			friend class ViewPort;
+		};
+
+	public:
+		explicit ViewPort(World* world);
+		~ViewPort();
+
+		// drawing
+		static constexpr Si32 zlStatic = 0; // z-sublevel for platforms, kept between frames and drawn first
+		const std::vector<Vec3Si32>& stale() const { return stale_; } // cells to draw static commands of
+		RenderCmnd::Filter FilterMode(Si32 wz);
+		RenderCmnd* GetRenderCmnd(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz);
+		RenderCmnd* GetRenderCmnd(Sprite* sprite, Vec3Si32 w);
+		RenderCmnd& Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl, Vec2Si32 off);
+		RenderCmnd& Draw(Sprite* sprite, Si32 wx, Si32 wy, Si32 wz, Si32 zl);
+		RenderCmnd& Draw(Sprite* sprite, Vec3Si32 w, Si32 zl, Vec2Si32 off);
+		RenderCmnd& Draw(Sprite* sprite, Vec3Si32 w, Si32 zl);
+		RenderCmnd& DrawShadow(Shadow shadow, Si32 wx, Si32 wy, Si32 wz, Si32 zl);
+
+		// rendering
+		void BeginRender(double time);
+		void EndRender(bool drawCeiling, Vec3Si32 w);
+
+		// backtrack
+		void Event(Vec2Si32 s, std::function<void(EventHandling& eh, Ui64 tag, void* data)> handler);
+
+		// navigation
+		void Move(Vec2F delta);
+		void MoveNoClamp(Vec2F delta);
+		void Locate(Vec2F loc);
+		void Center();
+		void IncVisibleZ();
+		void DecVisibleZ();
+        void SetVisibleZ(Si32 z);
+        Si32 visible_z() const { return visible_z_; }
+
+		// simulation support
+		double progress() const { return progress_; }
+		void set_progress(double progress) { progress_ = progress; }
+
+		// transformations
+		Vec3Si32 ToWorldAtZ(Si32 wz, Vec2Si32 p) const;
+		Vec3Si32 ToWorldTileAtZ(Si32 wz, Vec2Si32 p, Vec2F& tp) const;
+		bool ToWorld(Vec2Si32 p, Vec3Si32& w) const;
+		bool ToWorldTile(Vec2Si32 p, Vec3Si32& w, Vec2F& tp) const;
+
+		// world-related
+		World* world() const { return world_; }
+		void set_world(World* world); // listens to changes of `world' from now on
+		void OnChanges(const World& world, const std::vector<TileChange>& tiles,
+			const std::vector<RobotChange>& robots) override;
+		void OnEdit(const World& world) override;
+
+	private:
+		void ApplyCommands();
+		void DrawLayer(Pos p2, RenderList* rlist);
+		void Use(RenderList& rlist, Si32 zl);
+		void CollectStale();
+		void MarkDirty(Vec3Si32 w);
+		void InvalidateStatic();
+		void Reach(Si32 zl, Sprite* sprite, Vec2Si32 off);
+		void ResetReach(Si32 zl);
+		void VisibleCells(Si32 zl, Vec2Si32 s, Si32 n, Si32& kb, Si32& ke, Vec2Si32 clipLo, Vec2Si32 clipHi) const;
+		template <class F>
+		void ForEachVisibleCell(Pos p2, Si32 zl, F f);
+		template <class F>
+		void ForEachVisibleCell(Pos p2, Si32 zl, Vec2Si32 clipLo, Vec2Si32 clipHi, F f);
+		void DrawCeiling(Vec3Si32 w);
+
+		Pos GetPos(Si32 wx, Si32 wy, Si32 wz = 0);
+		Sprite ShadowMask(Sprite& surfaceMask, const Shadow& shadow);
+
+		Sprite transparent() { return transparent_; }
+		RenderList& renderList(Si32 wx, Si32 wy, Si32 wz, Si32 zl)
+		{
+			if (!(zl >= 0 && zl < zlSize)) {
+				abort();
+			}
+			wx -= boxOrigin_.x;
+			wy -= boxOrigin_.y;
+			if (!(wx >= 0 && wx < boxSize_.x && wy >= 0 && wy < boxSize_.y && wz >= 0 && wz < wparams_.zsize())) {
+				return discarded_;
+			}
+			return cmnds_[(((wz << zlBits) + zl) * boxSize_.y + wy) * boxSize_.x + wx];
+		}
+
+	private:
+		// world
+		WorldParams wparams_;
+		World* world_ = nullptr;
+
+		// screen offset in pixels
+		float x_ = 0;
+		float y_ = 0;
+		float xmin_ = 0;
+		float ymin_ = 0;
+		float xmax_ = 0;
+		float ymax_ = 0;
+
+		// world rendering parameters
+		Si32 visible_z_ = 0;
+		Si32 drawn_z_ = 0; // z-layers drawn in current frame
+
+		// time-related
+		double lastFrameTime_ = 0.0;
+		double curFrameTime_ = 0.0;
+		double progress_ = 1.0; // 0 - previous world state, 1 - current world state 
+
+		// rendering artifacts
+		static constexpr size_t zlBits = 2ull;
+		static constexpr size_t zlSize = 1ull << zlBits;
+		Vec2Si32 boxOrigin_ = Vec2Si32(0, 0); // bounding box of platforms, render lists cover
+		Vec2Si32 boxSize_ = Vec2Si32(0, 0); // only its cells on every z-level
+		std::vector<RenderList> cmnds_;
+		RenderList discarded_; // for cells outside of bounding box, never rendered
+		std::vector<Layer> layers_; // for every z-level
+		std::vector<Bitboard> dirty_; // cells of every z-level relative to bounding box, whose static
+		std::vector<Vec3Si32> stale_; // commands are to be drawn again, and such visible cells of current frame
+		std::vector<Vec3Si32> offscreen_; // dirty cells of drawn z-levels not visible in current frame
+		Vec2Si32 staleLo_ = Vec2Si32(0, 0); // static reach stale cells were collected with
+		Vec2Si32 staleHi_ = Vec2Si32(0, 0);
+		std::vector<RenderList*> used_; // dynamic render lists with commands of current
+		std::vector<RenderList*> lastUsed_; // and last frame
+		Vec2Si32 reachLo_[zlSize]; // screen rectangle relative to cell position covered by commands
+		Vec2Si32 reachHi_[zlSize]; // of z-sublevel in current frame or kept ones (for culling)
+		Sprite transparent_;
+		std::vector<Sprite> shadowMasks_; // indexed by ceiling bits, built for surface and projection below
+		Rgba* shadowSurface_ = nullptr;
+		Vec2Si32 shadowProj_ = Vec2Si32(0, 0);
+	};
+}
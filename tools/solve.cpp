@@ -0,0 +1,416 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+// Headless solver: searches placements of robots and allowed letters that
+// make level output correct, reports solutions with fewest letters and steps.
+//
+// usage: pilecode_solve LEVEL [--max-letters N] [--max-robots N]
+//                       [--max-steps N] [--max-nodes N] [--threads N]
+
+#include "levels.h"
+#include "pilecode.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using namespace pilecode; // NOLINT
+
+namespace {
+
+	const char* g_letterName[kLtMax] = {
+		"space", "right", "down", "up", "left", "input", "output",
+		"ccw", "cw", "eq", "ne", "lt", "gt",
+		"circles", "contrast", "brightness", "emit", "dot"
+	};
+
+	// Single change made to level by player
+	struct Edit {
+		Vec3Si32 w;
+		Letter letter; // kLtSpace to place robot
+	};
+
+	bool operator<(const Edit& a, const Edit& b)
+	{
+		if (a.w.z != b.w.z) return a.w.z < b.w.z;
+		if (a.w.y != b.w.y) return a.w.y < b.w.y;
+		if (a.w.x != b.w.x) return a.w.x < b.w.x;
+		return a.letter < b.letter;
+	}
+
+	struct Candidate {
+		std::vector<Edit> edits; // sorted, so that the same placements give the same state
+		Si32 letters = 0;
+		Si32 robots = 0;
+		size_t bound = 0; // steps of solved subset of edits to be beaten (0 if none)
+	};
+
+	struct Solution {
+		Candidate candidate;
+		size_t steps = 0;
+		bool found = false;
+	};
+
+	// Deques of tasks, one per worker: owner pops newest task (depth first),
+	// idle workers steal oldest ones (closer to root, so larger subtrees)
+	template <class Task>
+	class WorkStealingQueues {
+	public:
+		explicit WorkStealingQueues(size_t workers)
+			: queues_(workers)
+		{}
+
+		void Push(size_t worker, Task&& task)
+		{
+			pending_++;
+			Queue& q = queues_[worker];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.push_back(std::move(task));
+		}
+
+		// Returns false iff all tasks are done
+		bool Pop(size_t worker, Task& task)
+		{
+			while (pending_ > 0) {
+				for (size_t i = 0; i < queues_.size(); i++) {
+					Queue& q = queues_[(worker + i) % queues_.size()];
+					std::lock_guard<std::mutex> lock(q.mutex);
+					if (!q.tasks.empty()) {
+						if (i == 0) {
+							task = std::move(q.tasks.back());
+							q.tasks.pop_back();
+						}
+						else {
+							task = std::move(q.tasks.front());
+							q.tasks.pop_front();
+						}
+						return true;
+					}
+				}
+				std::this_thread::yield();
+			}
+			return false;
+		}
+
+		// Should be called after popped task is processed (and its subtasks pushed)
+		void Done()
+		{
+			pending_--;
+		}
+	private:
+		struct Queue {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+		std::vector<Queue> queues_;
+		std::atomic<size_t> pending_{0}; // pushed but not done tasks
+	};
+
+	// Set of state hashes of already explored candidates
+	class VisitedSet {
+	public:
+		// Returns false if hash was already inserted
+		bool Insert(Ui64 hash)
+		{
+			Shard& s = shards_[hash % kShards];
+			std::lock_guard<std::mutex> lock(s.mutex);
+			return s.hashes.insert(hash).second;
+		}
+	private:
+		static const size_t kShards = 64;
+		struct Shard {
+			std::mutex mutex;
+			std::unordered_set<Ui64> hashes;
+		};
+		Shard shards_[kShards];
+	};
+
+	class Solver {
+	public:
+		Solver(World* level, Si32 maxLetters, Si32 maxRobots, size_t maxSteps, size_t maxNodes)
+			: level_(level)
+			, maxLetters_(maxLetters)
+			, maxRobots_(maxRobots)
+			, maxSteps_(maxSteps)
+			, maxNodes_(maxNodes)
+		{}
+
+		void Solve(size_t threads)
+		{
+			WorkStealingQueues<Candidate> queues(threads);
+			Candidate root;
+			root.robots = level_->robots();
+			queues.Push(0, std::move(root));
+
+			auto worker = [&](size_t id) {
+				Candidate candidate;
+				while (queues.Pop(id, candidate)) {
+					Explore(id, candidate, queues);
+					queues.Done();
+				}
+			};
+			std::vector<std::thread> pool;
+			for (size_t t = 1; t < threads; t++) {
+				pool.emplace_back(worker, t);
+			}
+			worker(0);
+			for (auto& t : pool) {
+				t.join();
+			}
+		}
+
+		// accessors
+		const Solution& fewestLetters() const { return fewestLetters_; }
+		const Solution& fewestSteps() const { return fewestSteps_; }
+		size_t nodes() const { return std::min<size_t>(nodes_, maxNodes_); }
+		size_t steps() const { return steps_; }
+		bool exhaustive() const { return nodes_ <= maxNodes_; }
+	private:
+		World* Build(const Candidate& candidate) const
+		{
+			World* world = level_->Clone();
+			for (const Edit& e : candidate.edits) {
+				if (e.letter == kLtSpace) {
+					world->SwitchRobot(e.w, robot_);
+				}
+				else {
+					world->SetLetter(e.w, e.letter);
+				}
+			}
+			return world;
+		}
+
+		// Returns candidate with one more edit inserted in order
+		static Candidate Extend(const Candidate& candidate, Edit edit, size_t bound)
+		{
+			Candidate child = candidate;
+			child.edits.insert(std::upper_bound(child.edits.begin(), child.edits.end(), edit), edit);
+			if (edit.letter == kLtSpace) {
+				child.robots++;
+			}
+			else {
+				child.letters++;
+			}
+			child.bound = bound;
+			return child;
+		}
+
+		void Explore(size_t worker, const Candidate& candidate, WorkStealingQueues<Candidate>& queues)
+		{
+			std::unique_ptr<World> init(Build(candidate));
+			if (!visited_.Insert(init->hash()) || nodes_++ >= maxNodes_) {
+				return;
+			}
+
+			// Simulate candidate until it is solved, loops forever or reaches step cap
+			// Candidate with solved subset of edits has more edits, so it is better only if faster
+			size_t maxSteps = candidate.bound ? candidate.bound - 1 : maxSteps_;
+			std::unique_ptr<World> world(init->Clone());
+			bool solved = world->IsOutputCorrect();
+			while (!solved && world->loop() == 0 && world->steps() < maxSteps) {
+				world->Advance(maxSteps - world->steps());
+				solved = world->IsOutputCorrect();
+			}
+			steps_ += world->steps();
+			size_t bound = candidate.bound;
+			if (solved) {
+				Record(candidate, world->steps());
+				bound = world->steps();
+				if (bound == 0) {
+					return; // nothing is faster
+				}
+			}
+
+			// Letter on tile that was not touched would not change simulation, so
+			// only touched and still empty modifiable tiles are worth placing letters on
+			// (letter is set on covering tile, which is what modifiable bitboard tells about)
+			if (candidate.letters < maxLetters_) {
+				std::vector<Vec3Si32> cells;
+				for (Si32 z = 0; z < init->params().zsize(); z++) {
+					init->modifiable(z).ForEach([&](Si32 x, Si32 y) {
+						Vec3Si32 w(x, y, z);
+						if (world->IsTouched(w) && init->At(w)->letter() == kLtSpace) {
+							cells.push_back(w);
+						}
+					});
+				}
+				for (Vec3Si32 w : cells) {
+					for (Si32 l = kLtSpace + 1; l < kLtMax; l++) {
+						Letter letter = Letter(l);
+						if (init->IsLetterAllowed(letter)) {
+							queues.Push(worker, Extend(candidate, Edit{ w, letter }, bound));
+						}
+					}
+				}
+			}
+
+			// Robot could be placed onto any free movable tile
+			if (candidate.robots < maxRobots_) {
+				std::vector<Vec3Si32> cells;
+				for (Si32 z = 0; z < init->params().zsize(); z++) {
+					init->movable(z).ForEachExcept(init->occupied(z), [&](Si32 x, Si32 y) {
+						cells.emplace_back(x, y, z);
+					});
+				}
+				for (Vec3Si32 w : cells) {
+					queues.Push(worker, Extend(candidate, Edit{ w, kLtSpace }, bound));
+				}
+			}
+		}
+
+		void Record(const Candidate& candidate, size_t steps)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			Solution s;
+			s.candidate = candidate;
+			s.steps = steps;
+			s.found = true;
+			if (IsBetter(s, fewestLetters_, true)) {
+				fewestLetters_ = s;
+			}
+			if (IsBetter(s, fewestSteps_, false)) {
+				fewestSteps_ = s;
+			}
+		}
+
+		// Ties are broken by edits to make result independent of exploration order
+		static bool IsBetter(const Solution& a, const Solution& b, bool lettersFirst)
+		{
+			if (!b.found) {
+				return true;
+			}
+			const Candidate& ac = a.candidate;
+			const Candidate& bc = b.candidate;
+			if (lettersFirst && ac.letters != bc.letters) {
+				return ac.letters < bc.letters;
+			}
+			if (a.steps != b.steps) {
+				return a.steps < b.steps;
+			}
+			if (ac.letters != bc.letters) {
+				return ac.letters < bc.letters;
+			}
+			if (ac.robots != bc.robots) {
+				return ac.robots < bc.robots;
+			}
+			return ac.edits < bc.edits;
+		}
+
+	private:
+		std::unique_ptr<World> level_;
+		const Robot robot_;
+		Si32 maxLetters_;
+		Si32 maxRobots_;
+		size_t maxSteps_;
+		size_t maxNodes_;
+
+		VisitedSet visited_;
+		std::atomic<size_t> nodes_{0};
+		std::atomic<size_t> steps_{0};
+		std::mutex mutex_;
+		Solution fewestLetters_;
+		Solution fewestSteps_;
+	};
+
+}
+
+int main(int argc, char** argv)
+{
+	int level = -1;
+	Si32 maxLetters = 6;
+	Si32 maxRobots = -1;
+	size_t maxSteps = 1000;
+	size_t maxNodes = 1000000;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--max-letters" && hasValue) {
+			maxLetters = atoi(argv[++i]);
+		}
+		else if (arg == "--max-robots" && hasValue) {
+			maxRobots = atoi(argv[++i]);
+		}
+		else if (arg == "--max-steps" && hasValue) {
+			maxSteps = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--max-nodes" && hasValue) {
+			maxNodes = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--threads" && hasValue) {
+			threads = std::max(1ull, strtoull(argv[++i], nullptr, 10));
+		}
+		else if (level == -1 && !arg.empty() && isdigit(arg[0])) {
+			level = atoi(arg.c_str());
+		}
+		else {
+			level = -1;
+			break;
+		}
+	}
+	if (level < 0 || (size_t)level >= LevelsCount()) {
+		fprintf(stderr,
+			"usage: pilecode_solve LEVEL [--max-letters N] [--max-robots N]\n"
+			"                      [--max-steps N] [--max-nodes N] [--threads N]\n"
+			"  LEVEL           built-in level number (0..%d)\n"
+			"  --max-letters N letters to place at most (default 6)\n"
+			"  --max-robots N  robots in level at most (default is max of 1 and robots in level)\n"
+			"  --max-steps N   steps to simulate every candidate (default 1000)\n"
+			"  --max-nodes N   candidates to simulate at most (default 1000000)\n"
+			"  --threads N     number of worker threads (default is number of cores)\n",
+			int(LevelsCount()) - 1);
+		return 2;
+	}
+
+	World* world = GenerateLevel(level);
+	if (maxRobots < 0) {
+		maxRobots = std::max(1, world->robots());
+	}
+	Solver solver(world, maxLetters, maxRobots, maxSteps, maxNodes);
+	solver.Solve(threads);
+
+	auto report = [](const char* title, const Solution& s) {
+		if (!s.found) {
+			printf("%s: not found\n", title);
+			return;
+		}
+		printf("%s: %d letters, %d robots, %zu steps\n", title, s.candidate.letters, s.candidate.robots, s.steps);
+		for (const Edit& e : s.candidate.edits) {
+			printf("  %d %d %d %s\n", e.w.x, e.w.y, e.w.z, e.letter == kLtSpace ? "robot" : g_letterName[e.letter]);
+		}
+	};
+	report("fewest letters", solver.fewestLetters());
+	report("fewest steps", solver.fewestSteps());
+	fprintf(stderr, "%zu candidates, %zu steps simulated%s\n", solver.nodes(), solver.steps(),
+		solver.exhaustive() ? "" : " (node limit reached, search is not exhaustive)");
+	return solver.fewestLetters().found ? 0 : 1;
+}
@@ -0,0 +1,507 @@
+// The MIT License(MIT)
+//
+// Copyright 2017 bladez-fate
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and / or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+// Headless batch verifier: simulates built-in levels and/or saved profiles
+// until solved, looped or step cap is reached and reports per level stats.
+// With --check-sleep it compares levels and sparse randomized levels simulated with sleeping robots
+// and jumps to their reference runs simulating every robot step by step.
+// With --check-moves it simulates randomized levels step by step side by side with a reference run
+// resolving moves with the O(n^2) algorithm and compares their full state after every step.
+// With --bench it measures simulation of a crowd of robots on a large platform.
+//
+// usage: pilecode_verify [--levels] [--profile FILE]... [--check-sleep SEEDS] [--check-moves SEEDS]
+//                        [--bench ROBOTS] [--max-steps N] [--threads N] [--format csv|json]
+
+#include "levels.h"
+#include "pilecode.h"
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pilecode; // NOLINT
+
+namespace {
+
+	enum Outcome {
+		kOcSolved = 0, // output is correct
+		kOcLoop,       // simulation entered a cycle without correct output
+		kOcCap,        // step cap reached
+
+		kOcMax
+	};
+
+	const char* g_outcomeName[kOcMax] = { "solved", "loop", "cap" };
+
+	struct Job {
+		std::string source;
+		int level;
+		std::unique_ptr<World> world;
+		bool checkSleep = false; // compared with reference run without sleeping and jumps
+		bool checkMoves = false; // compared with reference run resolving moves pairwise
+		bool randomized = false; // with letters rewritten while it is compared with reference run
+		unsigned seed = 0;
+		bool bench = false; // simulated for exactly max steps, outcome is not checked
+
+		// results
+		Outcome outcome = kOcCap;
+		size_t steps = 0;
+		double seconds = 0.0;
+		size_t mismatches = 0; // steps with moves resolved differently (see World::set_check_moves())
+		size_t diverged = 0; // first step with state different from reference run (0 if none)
+	};
+
+	// Random letter, mostly directions to keep robots moving
+	Letter RandomLetter(std::mt19937& rng)
+	{
+		return rng() % 4 ? Letter(kLtRight + rng() % 4) : Letter(1 + rng() % (kLtMax - 1));
+	}
+
+	// Rewrites the same random letters on about 1/8 of modifiable tiles of both worlds,
+	// so that robots keep meeting instead of settling into a short loop
+	void Shake(World* world, World* reference, std::mt19937& rng)
+	{
+		std::vector<Vec3Si32> modifiable;
+		world->ForEachTile([&](Vec3Si32 w, const Tile* tile) {
+			if (world->At(w) == tile && tile->IsModifiable()) {
+				modifiable.push_back(w);
+			}
+		});
+		for (Vec3Si32 w : modifiable) {
+			if (rng() % 8 == 0) {
+				Letter letter = RandomLetter(rng);
+				world->SetLetter(w, letter);
+				reference->SetLetter(w, letter);
+			}
+		}
+	}
+
+	// Full simulation state of `world' (see World::SaveStep())
+	std::string SaveStep(const World& world)
+	{
+		BinaryWriter s;
+		world.SaveStep(s);
+		return std::move(s.data());
+	}
+
+	// Simulates randomized world and its reference clone, which resolves moves with reference algorithm
+	// (checking every step of world, see World::set_check_moves()) or simulates every robot step by step,
+	// until their states differ or max steps are made
+	void CheckReference(Job& job, size_t maxSteps)
+	{
+		const size_t kShakePeriod = 16;
+		World* world = job.world.get();
+		std::unique_ptr<World> reference(world->Clone());
+		if (job.checkMoves) {
+			reference->set_reference_moves(true);
+		}
+		else {
+			reference->set_simulate_all(true);
+		}
+		std::mt19937 rng(job.seed);
+		size_t shaken = 0;
+		while (world->steps() < maxSteps) {
+			if (world->steps() >= shaken + kShakePeriod) {
+				Shake(world, reference.get(), rng);
+				shaken = world->steps();
+			}
+			if (job.checkMoves) {
+				world->Simulate(); // jumps of Advance() do not resolve moves
+			}
+			else {
+				world->Advance(maxSteps - world->steps());
+			}
+			// jumped steps are not visited by `world', so it is compared after every step or jump
+			while (reference->steps() < world->steps()) {
+				reference->Simulate();
+			}
+			if (world->hash() != reference->hash() || SaveStep(*world) != SaveStep(*reference)) {
+				job.diverged = world->steps();
+				break;
+			}
+		}
+		job.outcome = world->IsOutputCorrect() ? kOcSolved : world->loop() != 0 ? kOcLoop : kOcCap;
+	}
+
+	void Verify(Job& job, size_t maxSteps)
+	{
+		auto start = std::chrono::steady_clock::now();
+		World* world = job.world.get();
+		if (job.bench) {
+			job.outcome = kOcCap;
+			while (world->steps() < maxSteps) {
+				world->Simulate(); // robot-steps are measured, so no jumps
+			}
+		}
+		else if (job.randomized) {
+			CheckReference(job, maxSteps);
+		}
+		else if (world->IsOutputCorrect()) {
+			job.outcome = kOcSolved;
+		}
+		else {
+			job.outcome = kOcCap;
+			std::unique_ptr<World> reference;
+			if (job.checkSleep) {
+				reference.reset(world->Clone());
+				reference->set_simulate_all(true);
+			}
+			while (world->steps() < maxSteps) {
+				world->Advance(maxSteps - world->steps());
+				if (reference) {
+					// jumped steps are not visited by `world', so it is compared after every step or jump
+					while (reference->steps() < world->steps()) {
+						reference->Simulate();
+					}
+					if (reference->hash() != world->hash()) {
+						job.diverged = world->steps();
+						break;
+					}
+				}
+				if (world->IsOutputCorrect()) {
+					job.outcome = kOcSolved;
+					break;
+				}
+				if (world->loop() != 0) {
+					job.outcome = kOcLoop;
+					break;
+				}
+			}
+		}
+		job.steps = world->steps();
+		job.mismatches = world->move_mismatches();
+		job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		job.world.reset(); // free memory early
+	}
+
+	void VerifyAll(std::vector<Job>& jobs, size_t maxSteps, size_t threads)
+	{
+		// Workers take jobs one by one, so long levels do not stall the others
+		std::atomic<size_t> next(0);
+		auto worker = [&]() {
+			for (size_t i; (i = next++) < jobs.size(); ) {
+				Verify(jobs[i], maxSteps);
+			}
+		};
+		std::vector<std::thread> pool;
+		for (size_t t = 1; t < threads; t++) {
+			pool.emplace_back(worker);
+		}
+		worker();
+		for (auto& t : pool) {
+			t.join();
+		}
+	}
+
+	// Clone of `level' with random letters on modifiable tiles and robots with random
+	// priorities on every `robotOdds'-th movable tile on average
+	World* Randomize(const World& level, unsigned seed, unsigned robotOdds)
+	{
+		std::mt19937 rng(seed);
+		World* world = level.Clone();
+		std::vector<Vec3Si32> modifiable;
+		std::vector<Vec3Si32> movable;
+		world->ForEachTile([&](Vec3Si32 w, const Tile* tile) {
+			if (world->At(w) != tile) {
+				return; // covered by another platform
+			}
+			if (tile->IsModifiable()) {
+				modifiable.push_back(w);
+			}
+			if (tile->IsMovable()) {
+				movable.push_back(w);
+			}
+		});
+		for (Vec3Si32 w : modifiable) {
+			if (rng() % 2 == 0) {
+				world->SetLetter(w, RandomLetter(rng));
+			}
+		}
+		Robot robot;
+		for (Vec3Si32 w : movable) {
+			if (rng() % robotOdds == 0 && !world->IsRobotIn(w, w)) {
+				robot.set_priority(Si32(rng() % 3));
+				world->SwitchRobot(w, robot);
+			}
+		}
+		return world;
+	}
+
+	// Square brick platform with direction letters on half of tiles and `robots' robots standing
+	// on them with random priorities, about 4 cells per robot (200x200 for 10000 robots)
+	World* Sandbox(size_t robots, unsigned seed)
+	{
+		std::mt19937 rng(seed);
+		Si32 size = std::max(1, Si32(std::ceil(std::sqrt(robots * 4.0))));
+		World* world = new World(WorldParams(size, size, 2, 3));
+		world->AddPlatform(new Platform(0, 0, 0, size, size, kTlBrick));
+		std::vector<Vec3Si32> lettered;
+		for (Si32 y = 0; y < size; y++) {
+			for (Si32 x = 0; x < size; x++) {
+				if (rng() % 2 == 0) {
+					lettered.emplace_back(x, y, 0);
+					world->SetLetter(lettered.back(), Letter(kLtRight + rng() % 4));
+				}
+			}
+		}
+		std::shuffle(lettered.begin(), lettered.end(), rng);
+		lettered.resize(std::min(robots, lettered.size()));
+		for (Vec3Si32 w : lettered) {
+			Robot robot(world, w);
+			robot.set_priority(Si32(rng() % 3));
+			world->AddRobot(robot);
+		}
+		return world;
+	}
+
+	std::string JsonEscape(const std::string& str)
+	{
+		std::string result;
+		for (char c : str) {
+			if (c == '"' || c == '\\') {
+				result += '\\';
+			}
+			result += c;
+		}
+		return result;
+	}
+
+	double StepsPerSecond(const Job& job)
+	{
+		return job.seconds > 0.0 ? job.steps / job.seconds : 0.0;
+	}
+
+	void ReportCsv(const std::vector<Job>& jobs)
+	{
+		printf("source,level,outcome,steps,wall_ms,steps_per_sec\n");
+		for (const Job& job : jobs) {
+			printf("%s,%d,%s,%zu,%.3lf,%.0lf\n", job.source.c_str(), job.level,
+				g_outcomeName[job.outcome], job.steps, job.seconds * 1e3, StepsPerSecond(job));
+		}
+	}
+
+	void ReportJson(const std::vector<Job>& jobs)
+	{
+		printf("[\n");
+		for (size_t i = 0; i < jobs.size(); i++) {
+			const Job& job = jobs[i];
+			printf("  {\"source\": \"%s\", \"level\": %d, \"outcome\": \"%s\", \"steps\": %zu, "
+				"\"wall_ms\": %.3lf, \"steps_per_sec\": %.0lf}%s\n",
+				JsonEscape(job.source).c_str(), job.level, g_outcomeName[job.outcome],
+				job.steps, job.seconds * 1e3, StepsPerSecond(job), i + 1 < jobs.size() ? "," : "");
+		}
+		printf("]\n");
+	}
+
+	void Usage()
+	{
+		fprintf(stderr,
+			"usage: pilecode_verify [--levels] [--profile FILE]... [--check-sleep SEEDS] [--check-moves SEEDS]\n"
+			"                       [--bench ROBOTS] [--max-steps N] [--threads N] [--format csv|json]\n"
+			"  --levels            verify built-in levels (default if nothing else is given)\n"
+			"  --profile FILE      verify every level saved in player profile FILE\n"
+			"  --check-sleep SEEDS compare levels, profiles and SEEDS sparse randomized variants of every\n"
+			"                      built-in level after every step or jump with reference run without\n"
+			"                      sleeping robots and jumps (exits with 1 on any mismatch)\n"
+			"  --check-moves SEEDS check move resolution on SEEDS randomized variants of every\n"
+			"                      built-in level against reference run (exits with 1 on any mismatch)\n"
+			"  --bench ROBOTS      simulate ROBOTS robots on a large platform step by step\n"
+			"  --max-steps N       stop simulation after N steps (default 1000000,\n"
+			"                      1000 for sleep checks, randomized levels and benchmark)\n"
+			"  --threads N         number of worker threads (default is number of cores)\n"
+			"  --format F          output format: csv (default) or json\n");
+		exit(2);
+	}
+
+}
+
+int main(int argc, char** argv)
+{
+	bool levels = false;
+	std::vector<std::string> profiles;
+	size_t maxSteps = 0; // default depends on mode
+	bool checkSleep = false;
+	size_t sleepSeeds = 0;
+	size_t checkSeeds = 0;
+	size_t benchRobots = 0;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	bool json = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--levels") {
+			levels = true;
+		}
+		else if (arg == "--profile" && hasValue) {
+			profiles.push_back(argv[++i]);
+		}
+		else if (arg == "--check-sleep" && hasValue) {
+			checkSleep = true;
+			sleepSeeds = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--check-moves" && hasValue) {
+			checkSeeds = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--bench" && hasValue) {
+			benchRobots = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--max-steps" && hasValue) {
+			maxSteps = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--threads" && hasValue) {
+			threads = std::max(1ull, strtoull(argv[++i], nullptr, 10));
+		}
+		else if (arg == "--format" && hasValue) {
+			std::string format = argv[++i];
+			if (format == "json") {
+				json = true;
+			}
+			else if (format != "csv") {
+				Usage();
+			}
+		}
+		else {
+			Usage();
+		}
+	}
+	if (profiles.empty() && !checkSeeds && !benchRobots) {
+		levels = true;
+	}
+	if (!maxSteps) {
+		maxSteps = checkSleep || checkSeeds || benchRobots ? 1000 : 1000000; // these are stepped one by one
+	}
+
+	// Load all worlds up front, simulation is the only part done in parallel
+	std::vector<Job> jobs;
+	if (levels) {
+		for (size_t level = 0; level < LevelsCount(); level++) {
+			jobs.emplace_back();
+			jobs.back().source = "levels";
+			jobs.back().level = int(level);
+			jobs.back().world.reset(GenerateLevel(int(level)));
+			jobs.back().checkSleep = checkSleep;
+		}
+	}
+	// sparse robots mostly run alone and fall asleep or get jumped over,
+	// crowded ones often compete for cells
+	for (size_t seed = 0; seed < sleepSeeds; seed++) {
+		for (size_t level = 0; level < LevelsCount(); level++) {
+			std::unique_ptr<World> world(GenerateLevel(int(level)));
+			jobs.emplace_back();
+			jobs.back().source = "sleep:" + std::to_string(seed);
+			jobs.back().level = int(level);
+			jobs.back().seed = unsigned(seed * LevelsCount() + level);
+			jobs.back().world.reset(Randomize(*world, jobs.back().seed, 8));
+			jobs.back().checkSleep = true;
+			jobs.back().randomized = true;
+		}
+	}
+	for (size_t seed = 0; seed < checkSeeds; seed++) {
+		for (size_t level = 0; level < LevelsCount(); level++) {
+			std::unique_ptr<World> world(GenerateLevel(int(level)));
+			jobs.emplace_back();
+			jobs.back().source = "random:" + std::to_string(seed);
+			jobs.back().level = int(level);
+			jobs.back().seed = unsigned(seed * LevelsCount() + level);
+			jobs.back().world.reset(Randomize(*world, jobs.back().seed, 2));
+			jobs.back().world->set_check_moves(true);
+			jobs.back().checkMoves = true;
+			jobs.back().randomized = true;
+		}
+	}
+	if (benchRobots) {
+		jobs.emplace_back();
+		jobs.back().source = "bench:" + std::to_string(benchRobots);
+		jobs.back().level = 0;
+		jobs.back().world.reset(Sandbox(benchRobots, 0));
+		jobs.back().bench = true;
+	}
+	for (const std::string& path : profiles) {
+		PlayerProfile profile(path);
+		if (!profile.LoadFromDisk()) {
+			fprintf(stderr, "unable to read profile %s\n", path.c_str());
+			return 1;
+		}
+		for (size_t level = 0; level < profile.levels(); level++) {
+			jobs.emplace_back();
+			jobs.back().source = path;
+			jobs.back().level = int(level);
+			jobs.back().world.reset(profile.GetSavedWorld(int(level)));
+			jobs.back().checkSleep = checkSleep;
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	VerifyAll(jobs, maxSteps, std::min(threads, std::max<size_t>(1, jobs.size())));
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (json) {
+		ReportJson(jobs);
+	}
+	else {
+		ReportCsv(jobs);
+	}
+
+	size_t steps = 0;
+	size_t solved = 0;
+	size_t mismatches = 0;
+	size_t diverged[2] = {}; // runs of sleep and moves checks
+	for (const Job& job : jobs) {
+		if (job.bench) {
+			fprintf(stderr, "%s: %.1lf ns per robot-step\n", job.source.c_str(),
+				job.steps ? job.seconds * 1e9 / job.steps / benchRobots : 0.0);
+		}
+		steps += job.steps;
+		solved += (job.outcome == kOcSolved);
+		if (job.mismatches) {
+			fprintf(stderr, "%s level %d: moves resolved differently in %zu steps\n",
+				job.source.c_str(), job.level, job.mismatches);
+			mismatches += job.mismatches;
+		}
+		if (job.diverged) {
+			fprintf(stderr, "%s level %d: state differs from reference run after step %zu\n",
+				job.source.c_str(), job.level, job.diverged);
+			diverged[job.checkMoves]++;
+		}
+	}
+	fprintf(stderr, "%zu/%zu solved, %zu steps in %.3lf s (%.0lf steps/s) on %zu threads\n",
+		solved, jobs.size(), steps, seconds, seconds > 0.0 ? steps / seconds : 0.0, threads);
+	if (checkSleep) {
+		fprintf(stderr, "sleeping and jumps: %zu runs differ from reference\n", diverged[0]);
+	}
+	if (checkSeeds) {
+		fprintf(stderr, "move resolution: %zu mismatching steps, %zu runs differ from reference\n",
+			mismatches, diverged[1]);
+	}
+	return mismatches || diverged[0] || diverged[1] ? 1 : 0;
+}